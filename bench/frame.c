@@ -0,0 +1,91 @@
+/*
+ * Frame assembly: the time, reallocs and bytes written for one frame of a
+ * 200x60 terminal, with the output thrown away.
+ *
+ *   cc -O2 -pthread -o frame bench/frame.c
+ *   ./frame file.c
+ *
+ * Run it from the top of the tree, where config.txt is.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <time.h>
+
+static long reallocs;
+
+static void *countRealloc(void *p, size_t n) {
+    reallocs++;
+    return realloc(p, n);
+}
+
+#define realloc countRealloc
+#define main kayrak_main
+#include "../kayrak.c"
+#undef main
+#undef realloc
+
+static FILE *report;
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+enum frameKind { FRAME_REPAINT, FRAME_SCROLL, FRAME_TYPE, FRAME_SAME };
+
+static void run(const char *name, enum frameKind kind, int frames) {
+    long r = reallocs;
+    size_t bytes = E.screen.totalbytes;
+    double t = now();
+    int i;
+
+    for (i = 0; i < frames; i++) {
+        if (kind == FRAME_REPAINT) E.screen.valid = 0;
+        else if (kind == FRAME_SCROLL) E.cy++;
+        else if (kind == FRAME_TYPE) editorInsertChar('a' + i % 26);
+        editorRefreshScreen();
+    }
+
+    t = now() - t;
+    fprintf(report, "%-14s %8.1f us/frame %8.1f reallocs/frame %8zu bytes/frame\n", name,
+        t / frames * 1e6, (double)(reallocs - r) / frames, (E.screen.totalbytes - bytes) / frames);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s file\n", argv[0]);
+        return 1;
+    }
+
+    // frames go to /dev/null, the numbers to what was stdout
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    int null = open("/dev/null", O_WRONLY);
+    if (report == NULL || null == -1 || dup2(null, STDOUT_FILENO) == -1) die("/dev/null");
+
+    editorSetConfig();
+    E.cx = HL_config.LineNumberMargin;
+    E.dirtyrow = INT_MAX;
+    screenInit(62, 200);
+    E.screenrows = 60;
+    E.screencolumns = 200;
+    editorOpen(argv[1]);
+    editorLoadWait();
+
+    // highlighted before anything is timed
+    editorRefreshScreen();
+    while (HL_worker.job) {
+        usleep(1000);
+        if (editorSyntaxCollect()) editorRefreshScreen();
+    }
+    E.cy = E.screenrows - 1;
+    editorRefreshScreen();
+
+    run("full repaint", FRAME_REPAINT, 2000);
+    run("scroll", FRAME_SCROLL, 2000);
+    E.cx = HL_config.LineNumberMargin + 40;
+    run("typing", FRAME_TYPE, 2000);
+    run("unchanged", FRAME_SAME, 2000);
+    return 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * Highlighting throughput: every row of a file run through
+ * editorUpdateSyntax in order, in megabytes of rendered text per second.
+ *
+ *   cc -O2 -pthread -o highlight bench/highlight.c
+ *   ./highlight big.c
+ *
+ * Run it from the top of the tree, where config.txt is. It only calls
+ * functions older than the table-driven lexer, so for a before and after,
+ * build it again with -DKAYRAK='"/path/to/old/kayrak.c"'.
+ */
+
+#define _GNU_SOURCE
+#include <time.h>
+
+#ifndef KAYRAK
+#define KAYRAK "../kayrak.c"
+#endif
+
+#define main kayrak_main
+#include KAYRAK
+#undef main
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s file.c\n", argv[0]);
+        return 1;
+    }
+    editorSetConfig();
+
+    // rows of their own, so no time goes to reading the file
+    FILE *fp = fopen(argv[1], "r");
+    if (fp == NULL) die("fopen");
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    while ((linelen = getline(&line, &linecap, fp)) != -1) {
+        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+            linelen--;
+        editorInsertRow(E.numrows, line, linelen);
+    }
+    free(line);
+    fclose(fp);
+
+    E.filename = strdup(argv[1]);
+    editorSelectSyntaxHighlight();
+    if (E.syntax == NULL) {
+        fprintf(stderr, "%s: no syntax for this file\n", argv[1]);
+        return 1;
+    }
+
+    int n = E.numrows, i, rep;
+    erow **rows = malloc(n * sizeof(erow *));
+    if (rows == NULL) die("malloc");
+    size_t bytes = 0;
+    for (i = 0; i < n; i++) {
+        rows[i] = editorRowAt(i);
+        bytes += rows[i]->rsize;
+    }
+
+    double best = 1e9;
+    for (rep = 0; rep < 3; rep++) {
+        double t = now();
+        for (i = 0; i < n; i++) editorUpdateSyntax(rows[i]);
+        t = now() - t;
+        if (t < best) best = t;
+    }
+    printf("%s: %d rows, %.1f MB in %.3f s, %.0f MB/s\n", argv[1], n, bytes / 1e6, best, bytes / best / 1e6);
+    return 0;
+}
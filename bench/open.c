@@ -0,0 +1,122 @@
+/*
+ * Opening a file: the getline loop editorOpen used to run, with a row for
+ * every line, against editorOpen now, and each newline scanner on its own.
+ *
+ *   cc -O2 -pthread -o open bench/open.c
+ *   ./open big.c
+ *
+ * Run it from the top of the tree, where config.txt is.
+ */
+
+#define _GNU_SOURCE
+#include <time.h>
+
+#define main kayrak_main
+#include "../kayrak.c"
+#undef main
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// the old way: every line read with getline and made a row
+static double openGetline(const char *path) {
+    double t = now();
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) die("fopen");
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    while ((linelen = getline(&line, &linecap, fp)) != -1) {
+        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+            linelen--;
+        editorInsertRow(E.numrows, line, linelen);
+    }
+    free(line);
+    fclose(fp);
+    t = now() - t;
+
+    editorFreeRows();
+    return t;
+}
+
+static double openMapped(char *path) {
+    double t = now();
+    editorOpen(path);
+    editorLoadWait();
+    t = now() - t;
+
+    editorFreeRows();
+    editorSourceClose();
+    return t;
+}
+
+static const char *scanners[] = { "scalar", "sse2", "avx2" };
+
+// the best of 3 runs of one scanner over the whole file, already mapped
+static double scan(int which, char *map, size_t size) {
+    double best = 1e9;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        editorSourceClose();
+        E.src.map = map;
+        E.src.size = size;
+        E.src.mapsize = size;
+
+        double t = now();
+        editorSourceAddLine(&E.src, 0);
+        if (which == 0) editorScanScalar(&E.src, 0, size);
+#if defined(__x86_64__)
+        else if (which == 1) editorScanSSE2(&E.src, 0, size);
+        else editorScanAVX2(&E.src, 0, size);
+#endif
+        t = now() - t;
+        if (t < best) best = t;
+
+        // the mapping is the caller's
+        E.src.map = NULL;
+    }
+    return best;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s file\n", argv[0]);
+        return 1;
+    }
+    editorSetConfig();
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) die(argv[1]);
+    size_t size = st.st_size;
+    char *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) die("mmap");
+
+    // in the page cache before anything is timed
+    volatile char sink = 0;
+    size_t i;
+    for (i = 0; i < size; i += 4096) sink += map[i];
+
+    printf("%-16s %8.3f s\n", "getline + rows", openGetline(argv[1]));
+    printf("%-16s %8.3f s\n", "editorOpen", openMapped(argv[1]));
+
+    int which, n = 1;
+#if defined(__x86_64__)
+    n = __builtin_cpu_supports("avx2") ? 3 : 2;
+#endif
+    for (which = 0; which < n; which++) {
+        double t = scan(which, map, size);
+        printf("%-16s %8.3f s %8.0f MB/s  %d lines, %zu cr, %zu lf, %zu crlf\n", scanners[which], t,
+            size / t / 1e6, E.src.numlines, E.src.cr, E.src.lf, E.src.crlf);
+    }
+
+    editorSourceClose();
+    munmap(map, size);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,69 @@
+/*
+ * Regex search throughput: the time to find every match of a query in the
+ * whole file, as a literal and as a regex, through the same search index
+ * Find uses. A query starting with "re:" is only run as a regex.
+ *
+ *   cc -O2 -pthread -o regex bench/regex.c
+ *   ./regex big.c [query...]
+ *
+ * Run it from the top of the tree, where config.txt is.
+ */
+
+#define _GNU_SOURCE
+#include <time.h>
+
+#define main kayrak_main
+#include "../kayrak.c"
+#undef main
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void run(const char *query, int regex) {
+    SEARCH.regex = regex;
+    double t = now();
+    editorSearchIndex(query);
+    while (editorSearchPending()) editorSearchSlice();
+    t = now() - t;
+
+    printf("%-5s %-28.28s %10zu matches %8.1f ms %6.0f MB/s %s\n", regex ? "regex" : "lit", query,
+        SEARCH.count, t * 1e3, E.src.size / t / 1e6, SEARCH.err ? SEARCH.err : "");
+    editorSearchIndexFree();
+}
+
+int main(int argc, char **argv) {
+    // literals both ways, then regexes, the last two exponential for a backtracking matcher
+    static const char *defaults[] = {
+        "zq", "return", "x4999999",
+        "re:^\\s*return", "re:x[0-9]+;$", "re:(if|for) \\(", "re:\\d{3}", "re:(a*)*b", "re:(x+x+)+y",
+    };
+    const char **queries = defaults;
+    int nq = sizeof(defaults) / sizeof(defaults[0]), i;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s file [query...]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2) {
+        queries = (const char **)&argv[2];
+        nq = argc - 2;
+    }
+
+    editorSetConfig();
+    E.screenrows = 22;
+    editorOpen(argv[1]);
+    editorLoadWait();
+
+    for (i = 0; i < nq; i++) {
+        if (strncmp(queries[i], "re:", 3) == 0) {
+            run(queries[i] + 3, 1);
+        } else {
+            run(queries[i], 0);
+            run(queries[i], 1);
+        }
+    }
+    return 0;
+}
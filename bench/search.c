@@ -0,0 +1,96 @@
+/*
+ * Literal search: counting every match of a query with searchBytes over the
+ * mapped file, against the old loop, strstr over each row's render.
+ *
+ *   cc -O2 -pthread -o search bench/search.c
+ *   ./search big.c [query...]
+ *
+ * Run it from the top of the tree, where config.txt is.
+ */
+
+#define _GNU_SOURCE
+#include <time.h>
+
+#define main kayrak_main
+#include "../kayrak.c"
+#undef main
+
+#define QUERIES_MAX (32)
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static size_t countBytes(const char *q, double *t) {
+    struct searchNeedle n;
+    const char *p = E.src.map, *end = E.src.map + E.src.size;
+    size_t count = 0;
+
+    *t = now();
+    searchCompile(&n, q, strlen(q));
+    while ((p = searchBytes(&n, p, end - p))) {
+        count++;
+        p += n.len;
+    }
+    *t = now() - *t;
+    return count;
+}
+
+static size_t countRender(char **render, const char *q, double *t) {
+    size_t count = 0, len = strlen(q);
+    int i;
+
+    *t = now();
+    for (i = 0; i < E.numrows; i++) {
+        const char *p = render[i];
+        while ((p = strstr(p, q))) {
+            count++;
+            p += len;
+        }
+    }
+    *t = now() - *t;
+    return count;
+}
+
+int main(int argc, char **argv) {
+    static const char *defaults[] = { "zq", "return", "x4999999", "/* comment */ if (a) { return \"q" };
+    const char **queries = defaults;
+    int nq = sizeof(defaults) / sizeof(defaults[0]), i;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s file [query...]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2) {
+        queries = (const char **)&argv[2];
+        nq = argc - 2 < QUERIES_MAX ? argc - 2 : QUERIES_MAX;
+    }
+
+    editorSetConfig();
+    editorOpen(argv[1]);
+    editorLoadWait();
+    if (E.src.map == NULL) {
+        fprintf(stderr, "%s: not mapped\n", argv[1]);
+        return 1;
+    }
+
+    size_t bytes[QUERIES_MAX];
+    double tbytes[QUERIES_MAX];
+    for (i = 0; i < nq; i++) bytes[i] = countBytes(queries[i], &tbytes[i]);
+
+    // strstr needs every row copied out of the mapping first, untimed
+    char **render = malloc(E.numrows * sizeof(char *));
+    if (render == NULL) die("malloc");
+    for (i = 0; i < E.numrows; i++) render[i] = editorRowAt(i)->render;
+
+    printf("%-36s %22s %22s\n", "query", "searchBytes", "strstr per row");
+    for (i = 0; i < nq; i++) {
+        double t;
+        size_t found = countRender(render, queries[i], &t);
+        printf("%-36.36s %10zu %8.1f ms %10zu %8.1f ms\n", queries[i], bytes[i], tbytes[i] * 1e3,
+            found, t * 1e3);
+    }
+    return 0;
+}
@@ -1,8 +1,13 @@
 /* INCLUDES */
 
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <stdarg.h>
-#include <sys\types.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -11,6 +16,16 @@
 #include <sys/ioctl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 /* DEFINES */
 
@@ -43,7 +58,8 @@ enum editorKey {
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    PASTE_KEY       // a bracketed paste, its text in E.input.paste
 };
 
 enum editorHighlight{
@@ -70,18 +86,142 @@ struct editorSyntax {
     char *multiline_comment_start;
     char *multiline_comment_end;
     int flags;
+    struct editorLexer *lexer;  // built from the above on first use
 };
 
 typedef struct erow {
-    int idx;
     int size;
     int rsize;
-    char *chars;
-    char *render;
+    char *chars;        // gap buffer, see GAP BUFFER
+    int gap, gaplen;
+    char *render;       // render and hl share one gap
     unsigned char *hl;  // highlighting
-    int hl_open_comment;
+    int rgap, rgaplen;
+    int tabs;           // '\t' count in chars
+    int *tabidx;        // where they are, see editorRowTabs
+    int tabsknown, tabcap;
+    int hl_open_comment; // comment state at the end of the row or span
+    int hl_start;       // comment state hl was lexed from, -1 if unknown
+    unsigned int gen;   // changes with the text or extent, 0 once deleted
+
+    // row rope links, see ROW STORE
+    struct erow *left, *right, *parent;
+    unsigned int prio;
+    int count;          // rows in this subtree
+    int lines;          // 1, or the size of a lazy span (chars == NULL)
+    int srcline;        // first line of the mapped file it came from, or -1
 }erow;
 
+#define LINE_BLOCK (256)
+
+struct editorSource {
+    char *map;          // the opened file, mapped read-only
+    size_t size;        // how much of it is text, see editorLoadCollect
+    size_t mapsize;
+    uint64_t *blockoff; // where each run of LINE_BLOCK lines starts
+    uint32_t *lineoff;  // where each line starts, relative to its block
+    int numlines;
+    int linecap;
+    size_t cr, lf, crlf;    // line ending counts
+    int prevcr;         // the last byte scanned was '\r'
+    char *path;         // the name it was opened or saved under
+    int shrunk;         // the file got shorter than the mapping, see editorMapFault
+};
+
+#define CELL_REVERSE (1<<0)
+
+struct cell {
+    char c;
+    unsigned char attr;
+    short fg, bg;       // 256 color indexes, -1 for the terminal's own
+};
+
+struct editorScreen {
+    int rows, cols;         // the whole terminal, bars included
+    struct cell *frame;     // being drawn
+    struct cell *shadow;    // what the terminal shows
+    int valid;              // 0 until the shadow has been painted once
+    int rowoff, coloff;     // the view the shadow was drawn at
+    size_t framebytes;      // written for the last frame
+    size_t totalbytes;
+};
+
+enum undoType {
+    UNDO_INSERT,
+    UNDO_DELETE
+};
+
+#define UNDO_NEWROW (1<<0)  // the insert added row y first
+
+struct undoRec {
+    struct undoRec *prev, *next;
+    int type, flags;
+    unsigned int group;     // nonzero for records undone as one
+    int y, x;
+    int len;
+    char text[];            // line breaks are '\n'
+};
+
+struct undoChunk {
+    struct undoChunk *prev, *next;
+    size_t used, cap;
+    char data[];
+};
+
+struct editorUndo {
+    struct undoChunk *first, *last;
+    struct undoRec *cur;    // the last edit in effect; undone ones follow it
+    struct undoRec *top;    // the last record in the log
+    size_t bytes;
+    unsigned int group;
+    int applying;           // replaying the log, not recording it
+};
+
+#define INPUT_BUF (4096)
+
+struct editorInput {
+    unsigned char buf[INPUT_BUF];   // read but not decoded yet
+    int len;
+    int keys[INPUT_BUF];            // decoded, waiting to be processed
+    int head, tail;
+    int pasting;                    // inside \x1b[200~ ... \x1b[201~
+    int pastecr;                    // the last pasted byte was '\r'
+    char *paste;
+    size_t pastelen, pastecap;
+};
+
+struct editorView {
+    int on;                 // opened with -R, see VIEWER
+    int fd;
+    size_t size;
+    char *map;              // the part of the file mapped right now
+    size_t mapoff, maplen;
+    size_t *offs;           // where each row starts, and where the last one ends
+    int offscap;
+    long firstline;         // line number of row 0, counting from 0
+    int exact;              // firstline was counted, not estimated
+    double linelen;         // average line length, for the estimates
+};
+
+struct editorFollow {
+    int on;                 // opened with -F, see FOLLOW
+    int fd;
+    int ifd;                // inotify
+    int wd, dirwd;          // watching the file, and its directory
+    char *path;
+    size_t size;            // bytes of the file in the buffer
+    int partial;            // the last row has no line ending yet
+    int toend;              // move to the last row once the file is loaded
+};
+
+struct searchNeedle {
+    const char *s;
+    size_t len;
+    struct reMatcher *re;           // a regex instead, for editorSearch
+    size_t split, period, keep;     // for Two-Way, see searchCompile
+    size_t shift[256];
+};
+
 struct editorConfig {
     int cx, cy; // x and y (column and row) of teh cursor
     int rx;
@@ -91,11 +231,20 @@ struct editorConfig {
     int screencolumns;
     int numrows;
     char *filename;
-    erow *row;
+    erow *rows;         // root of the row rope
+    struct editorSource src;
     int dirty;
-    char statusmsg[80];
+    int dirtyrow;       // rows before it still match the file on disk
+    int hlline;         // rows before it have up to date highlighting
+    unsigned int edits; // changes with any row, see editorSearchIndex
+    char statusmsg[128];
     time_t statusmsg_time;
     struct editorSyntax *syntax;
+    struct editorScreen screen;
+    struct editorInput input;
+    struct editorUndo undo;
+    struct editorView view;
+    struct editorFollow follow;
     struct termios orig_termios;
 };
 
@@ -113,6 +262,7 @@ struct editorHLConfig{
     int NumberColor;
     int MatchColor;
     int DefaultColor; 
+    int FrameStats;
 };
 
 struct editorHLConfig HL_config;
@@ -133,7 +283,8 @@ struct editorSyntax HLDB[] = {
         C_HL_extensions,
         C_HL_keywords,    
         "//", "/*", "*/",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        NULL
     },
 };
 
@@ -145,7 +296,35 @@ void editorSetStatusMessage(const char *fmt, ...);
 
 void editorRefreshScreen();
 
-char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorUpdateSyntax(erow *row);
+void editorRowTouch(erow *row);
+void editorRowAdopt(erow *row, char *s, int len);
+int editorSyntaxCollect();
+int editorSyntaxWakeFd();
+void editorSyntaxCancel();
+void editorSyntaxRetire(erow *row);
+
+int editorLoading();
+int editorSearchPending();
+int editorSearchSlice();
+int editorLoadWakeFd();
+int editorLoadCollect();
+void editorLoadStop();
+
+const char *searchBytes(const struct searchNeedle *n, const char *hay, size_t len);
+const char *searchBytesLast(const struct searchNeedle *n, const char *hay, size_t len);
+
+int editorFollowFd();
+int editorFollowEvent();
+int editorFollowCheck();
+
+void editorUndoRecord(int type, int y, int x, const char *s, int len, int flags);
+void editorJournalAppend(int type, int y, int x, const char *s, int len, int flags);
+void editorJournalRemove();
+
+#define PROMPT_EMPTY_OK (1<<0)   // Enter takes an empty answer too
+
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int flags);
 
 /* TERMINAL */
 
@@ -158,6 +337,7 @@ void die(const char *s) {
 }
 
 void disableRawMode() {
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);  // bracketed paste off
     if(tcsetattr(STDIN_FILENO, TCSAFLUSH, & E.orig_termios) == -1)
         die("tcsetattr");
 }
@@ -175,33 +355,207 @@ void enableRawMode() {
     raw.c_cc[VTIME] = 1;
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);  // bracketed paste on
 }
 
-int editorReadKey() {
-    int nread;
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) die("read");
+/*
+ * Keys are read in batches. Once poll() reports input, a single read() takes
+ * everything that is there. The bytes are decoded into E.input's key queue,
+ * and editorReadKey hands the keys out one at a time. The main loop only
+ * refreshes the screen when the queue is empty, so a burst of typing or key
+ * repeat costs one frame. poll() also watches the highlight worker's wake
+ * pipe, so an idle editor sleeps until there is a key or a finished job.
+ */
+
+#define ESC_TIMEOUT_MS (50)     // to tell a lone Esc from the start of a sequence
+
+// decodes a key from s, returning the bytes it takes, or 0 if s might be the
+// start of an escape sequence that has not all arrived yet; -1 for sequences
+// that are not keys
+static int editorDecodeKey(const unsigned char *s, int len, int *key) {
+    *key = s[0];
+    if (s[0] != '\x1b') return 1;
+    if (len < 2) return 0;
+
+    if (s[1] == 'O') {
+        if (len < 3) return 0;
+        switch (s[2]) {
+            case 'A': *key = ARROW_UP; break;
+            case 'B': *key = ARROW_DOWN; break;
+            case 'C': *key = ARROW_RIGHT; break;
+            case 'D': *key = ARROW_LEFT; break;
+            case 'H': *key = HOME_KEY; break;
+            case 'F': *key = END_KEY; break;
+            default: *key = -1; break;
+        }
+        return 3;
     }
-    
-    if (c == '\x1b') {
-        char seq[3];
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
-        
-        if (seq[0] == '[') {
-            switch (seq[1]) {
-                case 'A': return ARROW_UP;
-                case 'B': return ARROW_DOWN;
-                case 'C': return ARROW_RIGHT;
-                case 'D': return ARROW_LEFT;
+    if (s[1] != '[') return 1;
+
+    // CSI: parameters, then the final byte
+    int i = 2, param = 0, first = 1;
+    while (i < len && ((s[i] >= '0' && s[i] <= '9') || s[i] == ';')) {
+        if (s[i] == ';') first = 0;
+        else if (first && param < 1000) param = param * 10 + s[i] - '0';
+        i++;
+    }
+    if (i == len) return len < 16 ? 0 : 1;
+
+    switch (s[i]) {
+        case 'A': *key = ARROW_UP; break;
+        case 'B': *key = ARROW_DOWN; break;
+        case 'C': *key = ARROW_RIGHT; break;
+        case 'D': *key = ARROW_LEFT; break;
+        case 'H': *key = HOME_KEY; break;
+        case 'F': *key = END_KEY; break;
+        case '~':
+            switch (param) {
+                case 1: case 7: *key = HOME_KEY; break;
+                case 4: case 8: *key = END_KEY; break;
+                case 3: *key = DEL_KEY; break;
+                case 5: *key = PAGE_UP; break;
+                case 6: *key = PAGE_DOWN; break;
+                case 200: *key = PASTE_KEY; break;
+                default: *key = -1; break;
             }
+            break;
+        default: *key = -1; break;
+    }
+    return i + 1;
+}
+
+#define PASTE_END "\x1b[201~"
+
+// takes pasted text from the byte buffer, returning how much; 1 in *done once
+// the end of the paste was found and taken as well
+static int editorDecodePaste(const unsigned char *s, int len, int *done) {
+    struct editorInput *in = &E.input;
+    int marker = sizeof(PASTE_END) - 1;
+
+    unsigned char *end = memmem(s, len, PASTE_END, marker);
+    int n = end ? end - s : len;
+    *done = end != NULL;
+
+    // the start of a marker that is still on its way
+    if (!end) {
+        int k;
+        for (k = marker - 1; k > 0; k--)
+            if (k <= len && memcmp(s + len - k, PASTE_END, k) == 0) break;
+        n -= k;
+    }
+
+    if (in->pastelen + n > in->pastecap) {
+        in->pastecap = (in->pastelen + n) * 2;
+        in->paste = realloc(in->paste, in->pastecap);
+        if (in->paste == NULL) die("realloc");
+    }
+    // terminals paste line breaks as '\r'; the buffer wants '\n'
+    int i;
+    for (i = 0; i < n; i++) {
+        char c = s[i];
+        if (c == '\n' && in->pastecr) {
+            in->pastecr = 0;
+            continue;
+        }
+        in->pastecr = c == '\r';
+        in->paste[in->pastelen++] = in->pastecr ? '\n' : c;
+    }
+    return *done ? n + marker : n;
+}
+
+// moves what can be decoded from the byte buffer to the key queue; with
+// flush, a sequence that never completed is taken as a lone Esc
+static void editorDecodeInput(int flush) {
+    struct editorInput *in = &E.input;
+    int pos = 0;
+
+    while (pos < in->len && in->tail - in->head < INPUT_BUF) {
+        // a paste is queued as one key, and the rest of the input waits until
+        // it has been taken out of E.input.paste
+        if (in->pasting) {
+            int done;
+            int n = editorDecodePaste(&in->buf[pos], in->len - pos, &done);
+            pos += n;
+            if (!done) break;
+            in->pasting = 0;
+            in->keys[in->tail++ % INPUT_BUF] = PASTE_KEY;
+            break;
         }
 
-        return '\x1b';
-    } else {
-        return c;
+        int key;
+        int n = editorDecodeKey(&in->buf[pos], in->len - pos, &key);
+        if (n == 0) {
+            if (!flush) break;
+            n = 1;
+        }
+        pos += n;
+        if (key == PASTE_KEY) {
+            in->pasting = 1;
+            in->pastelen = 0;
+            in->pastecr = 0;
+        } else if (key != -1) {
+            in->keys[in->tail++ % INPUT_BUF] = key;
+        }
+    }
+    memmove(in->buf, &in->buf[pos], in->len - pos);
+    in->len -= pos;
+}
+
+int editorKeyPending() {
+    return E.input.head != E.input.tail;
+}
+
+int editorReadKey() {
+    struct editorInput *in = &E.input;
+
+    while (!editorKeyPending()) {
+        if (in->len) {
+            editorDecodeInput(0);
+            if (editorKeyPending()) break;
+        }
+
+        struct pollfd fds[4] = {
+            { STDIN_FILENO, POLLIN, 0 },
+            { editorSyntaxWakeFd(), POLLIN, 0 },
+            { editorLoadWakeFd(), POLLIN, 0 },
+            { editorFollowFd(), POLLIN, 0 },
+        };
+        // a search under way runs between keys, see editorSearchSlice
+        int timeout = in->len && !in->pasting ? ESC_TIMEOUT_MS : editorSearchPending() ? 0 : -1;
+        int ready = poll(fds, 4, timeout);
+        if (ready == -1 && errno != EINTR) die("poll");
+
+        if (ready == 0) {
+            if (timeout != 0) editorDecodeInput(1);
+            else if (editorSearchSlice()) editorRefreshScreen();
+            continue;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(fds[1].fd, drain, sizeof(drain)) > 0);
+            if (editorSyntaxCollect()) editorRefreshScreen();
+        }
+
+        // a followed file may have grown while it was loading
+        if (fds[2].revents & POLLIN && editorLoadCollect()) {
+            editorFollowCheck();
+            editorRefreshScreen();
+        }
+
+        if (fds[3].revents & POLLIN && editorFollowEvent()) editorRefreshScreen();
+
+        if (fds[0].revents & POLLIN && in->len < INPUT_BUF) {
+            ssize_t nread = read(STDIN_FILENO, &in->buf[in->len], INPUT_BUF - in->len);
+            if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+            if (nread > 0) in->len += nread;
+            editorDecodeInput(in->len == INPUT_BUF);
+        }
     }
+
+    int c = in->keys[in->head++ % INPUT_BUF];
+    if (in->head == in->tail) in->head = in->tail = 0;
+    return c;
 }
 
 int getCursorPosition(int *rows, int *cols) {  
@@ -238,607 +592,5818 @@ int getTermianlSize(int *rows, int *cols) {
     }
 }
 
-/* SYNTAX HIGLIGHTING */
+/* MAPPED FILE */
 
-int is_separator(int c) {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
-}
+/*
+ * A file is opened by mapping it and recording where each line starts; no
+ * row is allocated up front. The whole file starts out as one lazy span in
+ * the row rope and lines are copied out of the mapping only when a row is
+ * viewed, edited or searched.
+ *
+ * The mapping is shared, so lazy rows are the file as it is now, and a write
+ * from outside changes them. If the file shrinks, reading a page past its
+ * new end raises SIGBUS. editorMapFault maps zeros over the pages that are
+ * gone, so the read goes on in whichever thread made it, and editorMapCheck
+ * reports it from the main loop. Rows already copied out, the undo log and
+ * the journal are not touched.
+ */
+
+// records a line starting at off; fails if its block would span 4 GiB or memory runs out
+int editorSourceAddLine(struct editorSource *src, size_t off) {
+    if (off >= src->size) return 0;
+
+    int n = src->numlines;
+    if (n == src->linecap) {
+        int cap = src->linecap ? src->linecap * 2 : 4096;
+        uint32_t *lineoff = realloc(src->lineoff, cap * sizeof(uint32_t));
+        if (lineoff == NULL) return -1;
+        src->lineoff = lineoff;
+        uint64_t *blockoff = realloc(src->blockoff, (cap / LINE_BLOCK) * sizeof(uint64_t));
+        if (blockoff == NULL) return -1;
+        src->blockoff = blockoff;
+        src->linecap = cap;
+    }
 
-void editorUpdateSyntax(erow *row) {
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
+    if (n % LINE_BLOCK == 0) src->blockoff[n / LINE_BLOCK] = off;
+    if (off - src->blockoff[n / LINE_BLOCK] > UINT32_MAX) return -1;
 
-    if(E.syntax == NULL)    return;
+    src->lineoff[n] = off - src->blockoff[n / LINE_BLOCK];
+    src->numlines++;
+    return 0;
+}
 
-    char **keywords = E.syntax->keywords;
+int editorScanScalar(struct editorSource *src, size_t from, size_t to) {
+    char *map = src->map;
+    size_t i;
 
-    char *scs = E.syntax->singleline_comment_start;
-    char *mcs = E.syntax->multiline_comment_start;
-    char *mce = E.syntax->multiline_comment_end;
+    if (from >= to) return 0;
 
-    int scs_len = scs ? strlen(scs) : 0;
-    int mcs_len = mcs ? strlen(mcs) : 0;
-    int mce_len = mce ? strlen(mce) : 0;
-    
-    int prev_sep = 1;
-    int in_string = 0;
-    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment   );
-    
+    for (i = from; i < to; i++) src->cr += (map[i] == '\r');
 
-    int i = 0;
-    while (i < row->rsize) {
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+    for (i = from; i < to; i++) {
+        char *nl = memchr(&map[i], '\n', to - i);
+        if (nl == NULL) break;
+        i = nl - map;
 
-        if (scs_len && !in_string && !in_comment) {
-            if (!strncmp(&row->render[i], scs, scs_len)) {
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-                break;
-            }
-        }
-        
-        if (mcs_len && mce_len && !in_string) {
-            if (in_comment) {
-                row->hl[i] = HL_MLCOMMENT;
-                
-                if (!strncmp(&row->render[i], mce, mce_len)) {
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-                    i += mce_len;
-                    in_comment = 0;
-                    prev_sep = 1;
-                    continue;
-                } else {
-                    i++;
-                    continue;
-                }
-            } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-                i += mcs_len;
-                in_comment = 1;
-                continue;
-            }
-        }
-        
-        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-            if (in_string) {
-                row->hl[i] = HL_STRING;
+        src->lf++;
+        if (i > from ? map[i - 1] == '\r' : src->prevcr) src->crlf++;
+        if (editorSourceAddLine(src, i + 1) == -1) return -1;
+    }
 
-            if (c == '\\' && i + 1 < row->rsize) {
-                row->hl[i + 1] = HL_STRING;
-                i += 2;
-                continue;
-            }
+    src->prevcr = (map[to - 1] == '\r');
+    return 0;
+}
 
-                if (c == in_string) in_string = 0;
-                i++;
-                prev_sep = 1;
-                continue;
-            } else {
-                if (c == '"' || c == '\'') {
-                    in_string = c;
-                    row->hl[i] = HL_STRING;
-                    i++;
-                    continue;
-                }
-            }
-        }
-        
-        if(E.syntax->flags & HL_HIGHLIGHT_NUMBERS){
-            if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||(c == '.' && prev_hl == HL_NUMBER)) {            
-                row->hl[i] = HL_NUMBER;
-                i++;
-                prev_sep = 0;
-                continue;
-            }
-        }
+#if defined(__x86_64__)
 
-        if (prev_sep) {
-            int j;
-            for (j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen - 1] == '|';
-                
-                if (kw2) klen--;
-                if (!strncmp(&row->render[i], keywords[j], klen) &&
-                    is_separator(row->render[i + klen])) {
-                    
-                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    i += klen;
-                    break;
-                }
-            }
-            
-            if (keywords[j] != NULL) {
-                prev_sep = 0;
-                continue;
-            }
+/*
+ * Compares a whole vector against '\n' and '\r' at once and walks the set
+ * bits of the newline mask. A '\r\n' pair is a '\n' bit whose neighbour
+ * in the '\r' mask (carried over from the previous vector) is set.
+ */
+int editorScanSSE2(struct editorSource *src, size_t from, size_t to) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    size_t i;
+
+    for (i = from; i + 16 <= to; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&src->map[i]);
+        uint32_t lfmask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        uint32_t crmask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, cr));
+
+        src->cr += __builtin_popcount(crmask);
+        src->lf += __builtin_popcount(lfmask);
+        src->crlf += __builtin_popcount(lfmask & ((crmask << 1) | src->prevcr));
+        src->prevcr = crmask >> 15;
+
+        while (lfmask) {
+            if (editorSourceAddLine(src, i + __builtin_ctz(lfmask) + 1) == -1) return -1;
+            lfmask &= lfmask - 1;
         }
+    }
+    return editorScanScalar(src, i, to);
+}
 
-        prev_sep = is_separator(c);
-        i++;
+__attribute__((target("avx2")))
+int editorScanAVX2(struct editorSource *src, size_t from, size_t to) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    size_t i;
+
+    for (i = from; i + 32 <= to; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&src->map[i]);
+        uint32_t lfmask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        uint32_t crmask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cr));
+
+        src->cr += __builtin_popcount(crmask);
+        src->lf += __builtin_popcount(lfmask);
+        src->crlf += __builtin_popcount(lfmask & ((crmask << 1) | src->prevcr));
+        src->prevcr = crmask >> 31;
+
+        while (lfmask) {
+            if (editorSourceAddLine(src, i + __builtin_ctz(lfmask) + 1) == -1) return -1;
+            lfmask &= lfmask - 1;
+        }
     }
+    return editorScanScalar(src, i, to);
+}
 
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < E.numrows)
-        editorUpdateSyntax(&E.row[row->idx + 1]);
+#endif
+
+// indexes the line starts in map[from, to), picking the widest scanner
+int editorSourceScan(struct editorSource *src, size_t from, size_t to) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) return editorScanAVX2(src, from, to);
+    return editorScanSSE2(src, from, to);
+#else
+    return editorScanScalar(src, from, to);
+#endif
 }
 
-int editorSyntaxToColor(int hl) {
-    switch (hl) {
-        case HL_KEYWORD1: return HL_config.KeywordColor;
-        case HL_KEYWORD2: return HL_config.VariableColor;
-        case HL_COMMENT: return HL_config.CommentColor;
-        case HL_MLCOMMENT: return HL_config.MultilineCommentColor;
-        case HL_STRING: return HL_config.StringColor;
-        case HL_NUMBER: return HL_config.NumberColor;
-        case HL_MATCH: return HL_config.MatchColor;
-        default: return HL_config.DefaultColor;
-    }
+/*
+ * What editorMapFault may patch. It reads only these, never E.src or E.view,
+ * which change under it: each mapping is published here once it is made and
+ * withdrawn before it is unmapped.
+ */
+enum { MAP_SOURCE, MAP_VIEW };
+
+static struct {
+    char *volatile map;
+    volatile size_t len;
+} mapped[2];
+
+static volatile sig_atomic_t mapfaulted;
+static size_t mappage;
+static struct sigaction mapdefault;
+
+static void editorMapTrack(int which, char *map, size_t len) {
+    mapped[which].map = NULL;
+    mapped[which].len = len;
+    mapped[which].map = map;
 }
 
-void editorSelectSyntaxHighlight() {
-    E.syntax = NULL;
-    
-    if (E.filename == NULL) return;
-    
-    char *ext = strrchr(E.filename, '.');
-    
-    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-        struct editorSyntax *s = &HLDB[j];
-        unsigned int i = 0;
-        
-        while (s->filematch[i]) {
-            int is_ext = (s->filematch[i][0] == '.');
-            
-            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-                (!is_ext && strstr(E.filename, s->filematch[i]))) {
-                E.syntax = s;
+/*
+ * SIGBUS on a page of a mapping that the file no longer has. Mapping zeros
+ * over it with MAP_FIXED is not on POSIX's list of async-signal-safe calls;
+ * this relies on Linux, where mmap is a plain system call that takes no
+ * locks, and where the faulting read is retried once the handler returns.
+ */
+static void editorMapFault(int sig, siginfo_t *si, void *ctx) {
+    (void)sig;
+    (void)ctx;
+    char *addr = si->si_addr;
+    int i;
 
-                //re highlighting
-                int filerow;
-                for (filerow = 0; filerow < E.numrows; filerow++) {
-                    editorUpdateSyntax(&E.row[filerow]);
-                }
+    for (i = 0; i < 2; i++) {
+        char *map = mapped[i].map;
+        size_t len = mapped[i].len;
+        if (map == NULL || addr < map || addr >= map + len) continue;
 
-                return;
-            }
-            i++;
+        // the pages after a missing one are missing too
+        char *from = map + (addr - map) / mappage * mappage;
+        if (mmap(from, map + len - from, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+            mapfaulted = 1;
+            return;
         }
+        break;
     }
+
+    // not ours: fault again, and die of it
+    sigaction(SIGBUS, &mapdefault, NULL);
 }
 
-/* row operations */
+void editorMapGuard() {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = editorMapFault;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    memset(&mapdefault, 0, sizeof(mapdefault));
+    mapdefault.sa_handler = SIG_DFL;
+    sigemptyset(&mapdefault.sa_mask);
+    mappage = sysconf(_SC_PAGESIZE);
+    if (sigaction(SIGBUS, &sa, NULL) == -1) die("sigaction");
+}
 
-int editorRowCxToRx(erow *row, int cx) {
-    int rx = 0;
-    int j;
-        for (j = 0; j < cx; j++) {
-        if (row->chars[j] == '\t')
-            rx += 7 - (rx % 8);
-            rx++;
-        }
-    return rx;
+void editorSourceClose() {
+    struct editorSource *src = &E.src;
+
+    editorLoadStop();
+    editorSyntaxCancel();
+    editorMapTrack(MAP_SOURCE, NULL, 0);
+    if (src->map) munmap(src->map, src->mapsize);
+    free(src->blockoff);
+    free(src->lineoff);
+    free(src->path);
+    memset(src, 0, sizeof(*src));
 }
 
-int editorRowRxToCx(erow *row, int rx) {
-    int cur_rx = 0;
-    int cx;
-    
-    for (cx = 0; cx < row->size; cx++) {
-        if (row->chars[cx] == '\t')
-            cur_rx += (HL_config.TabStop - 1) - (cur_rx % HL_config.TabStop);
-        
-        cur_rx++;
-        
-        if (cur_rx > rx) return cx;
+/*
+ * Reports a file that shrank under its mapping. Returns 1 if it did. The
+ * text it lost reads as zero bytes from now on, and the buffer counts as
+ * changed, so quitting asks first and a save writes the whole file.
+ */
+int editorMapCheck() {
+    if (!mapfaulted) return 0;
+    mapfaulted = 0;
+
+    if (!E.view.on) {
+        E.src.shrunk = 1;
+        E.dirty++;
+        E.edits++;
     }
-    return cx;
+    editorSetStatusMessage("%s changed on disk and lost text this buffer had not read yet",
+        E.filename ? E.filename : "The file");
+    return 1;
 }
 
-void editorUpdateRow(erow *row) {
-    int tabs;
-    int j;
-    for (j = 0; j < row->size; j++)
-        if(row->chars[j] == '\t')  tabs++;
+// maps fd, leaving only the first line start indexed
+int editorSourceMap(int fd, size_t size) {
+    struct editorSource *src = &E.src;
 
-    free(row->render);
-    row->render = malloc(row->size + tabs*(HL_config.TabStop-1) + 1);
+    editorSourceClose();
+    if (size == 0) return 0;
 
-    int idx = 0;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t'){
-            row->render[idx++] = ' ';
-            while(idx % HL_config.TabStop != 0) row->render[idx++] = ' ';
-        }else{
-            row->render[idx++] = row->chars[j];
-        }
+    src->map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (src->map == MAP_FAILED) {
+        src->map = NULL;
+        return -1;
     }
+    src->size = size;
+    src->mapsize = size;
+    editorMapTrack(MAP_SOURCE, src->map, size);
 
-    row->render[idx] = '\0';
-    row->rsize = idx;
+    if (editorSourceAddLine(src, 0) == -1) {
+        editorSourceClose();
+        return -1;
+    }
+    return 0;
+}
 
-    editorUpdateSyntax(row);
+// maps fd and indexes every line in it
+int editorSourceOpen(int fd, size_t size) {
+    if (editorSourceMap(fd, size) == -1) return -1;
+    if (size && editorSourceScan(&E.src, 0, size) == -1) {
+        editorSourceClose();
+        return -1;
+    }
+    return 0;
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
-    if (at < 0 || at > E.numrows) return;
-    
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-    for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
+size_t editorSourceOffset(int at) {
+    struct editorSource *src = &E.src;
+    if (at >= src->numlines) return src->size;
+    return src->blockoff[at / LINE_BLOCK] + src->lineoff[at];
+}
 
-    E.row[at].idx = at;
-    
-    E.row[at].size = len;
-    
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    
-    E.row[at].chars[len] = '\0';
+// returns the line holding byte `off` of the mapped file
+int editorSourceLineAt(size_t off) {
+    struct editorSource *src = &E.src;
+    if (src->numlines == 0) return 0;
+
+    int lo = 0, hi = (src->numlines - 1) / LINE_BLOCK;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (src->blockoff[mid] <= off) lo = mid;
+        else hi = mid - 1;
+    }
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
+    int first = lo * LINE_BLOCK;
+    int last = first + LINE_BLOCK - 1;
+    if (last >= src->numlines) last = src->numlines - 1;
 
-    E.numrows++;
-    E.dirty++;
+    while (first < last) {
+        int mid = (first + last + 1) / 2;
+        if (editorSourceOffset(mid) <= off) first = mid;
+        else last = mid - 1;
+    }
+    return first;
 }
 
-void editorFreeRow(erow *row) {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+// returns line `at` of the mapped file, without its line ending
+char *editorSourceLine(int at, int *len) {
+    struct editorSource *src = &E.src;
+    size_t start = editorSourceOffset(at);
+    size_t end = editorSourceOffset(at + 1);
+
+    while (end > start && (src->map[end - 1] == '\n' || src->map[end - 1] == '\r'))
+        end--;
+
+    *len = end - start;
+    return &src->map[start];
 }
 
-void editorDelRow(int at) {
-    if (at < 0 || at >= E.numrows) return;
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    for (int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
+/* ROW STORE */
 
-    E.numrows--;
-    E.dirty++;
+/*
+ * Rows are kept in an implicit treap (the "row rope") ordered by position,
+ * so inserting or deleting a line is O(log n) instead of a realloc + memmove
+ * of the whole row array. A row's index is not stored anywhere: it is the
+ * number of rows before it, recovered by walking up the parent links.
+ *
+ * A node with chars == NULL is a lazy span standing for `lines` consecutive
+ * lines of the mapped file that have not been loaded yet. Splitting the rope
+ * inside a span cuts the span in two.
+ */
+
+erow *editorNewSpan(int srcline, int lines) {
+    erow *span = calloc(1, sizeof(erow));
+    span->srcline = srcline;
+    span->lines = lines;
+    span->count = lines;
+    span->prio = (unsigned int)rand();
+    span->hl_start = -1;
+    editorRowTouch(span);
+    return span;
 }
 
-void editorRowInsertChar(erow *row, int at, int c) {
-    at -= HL_config.LineNumberMargin;
-    if (at < 0 || at > row->size) at = row->size;
-    
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    
-    row->size++;
-    row->chars[at] = c;
-    
-    editorUpdateRow(row);
-    E.dirty++;
+int ropeCount(erow *t) {
+    return t ? t->count : 0;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
+void ropeUpdate(erow *t) {
+    t->count = ropeCount(t->left) + ropeCount(t->right) + t->lines;
+    if (t->left) t->left->parent = t;
+    if (t->right) t->right->parent = t;
+}
+
+erow *ropeMerge(erow *l, erow *r) {
+    if (l == NULL) return r;
+    if (r == NULL) return l;
+
+    if (l->prio > r->prio) {
+        l->right = ropeMerge(l->right, r);
+        ropeUpdate(l);
+        return l;
+    } else {
+        r->left = ropeMerge(l, r->left);
+        ropeUpdate(r);
+        return r;
+    }
+}
+
+// splits t into the first k rows (*l) and the rest (*r)
+void ropeSplit(erow *t, int k, erow **l, erow **r) {
+    if (t == NULL) {
+        *l = *r = NULL;
+        return;
+    }
+
+    int lc = ropeCount(t->left);
+    if (lc < k && k < lc + t->lines) {
+        erow *rest = editorNewSpan(t->srcline + (k - lc), t->lines - (k - lc));
+        t->lines = k - lc;
+        t->hl_start = -1;
+        editorRowTouch(t);
+        *r = ropeMerge(rest, t->right);
+        t->right = NULL;
+        *l = t;
+    } else if (lc < k) {
+        ropeSplit(t->right, k - lc - t->lines, &t->right, r);
+        *l = t;
+    } else {
+        ropeSplit(t->left, k, l, &t->left);
+        *r = t;
+    }
+    ropeUpdate(t);
+}
+
+erow *ropeFirst(erow *t) {
+    if (t == NULL) return NULL;
+    while (t->left) t = t->left;
+    return t;
+}
+
+erow *ropeLast(erow *t) {
+    if (t == NULL) return NULL;
+    while (t->right) t = t->right;
+    return t;
+}
+
+// returns the node holding row `at`, which may be a lazy span
+erow *ropeFind(int at, int *off) {
+    if (at < 0 || at >= E.numrows) return NULL;
+
+    erow *t = E.rows;
+    while (t) {
+        int lc = ropeCount(t->left);
+        if (at < lc) {
+            t = t->left;
+        } else if (at < lc + t->lines) {
+            if (off) *off = at - lc;
+            return t;
+        } else {
+            at -= lc + t->lines;
+            t = t->right;
+        }
+    }
+    return NULL;
+}
+
+int editorRowIndex(erow *row) {
+    int idx = ropeCount(row->left);
+    for (; row->parent; row = row->parent) {
+        if (row == row->parent->right)
+            idx += ropeCount(row->parent->left) + row->parent->lines;
+    }
+    return idx;
+}
+
+erow *editorRowNext(erow *row) {
+    if (row->right) return ropeFirst(row->right);
+    while (row->parent && row == row->parent->right) row = row->parent;
+    return row->parent;
+}
+
+erow *editorRowPrev(erow *row) {
+    if (row->left) return ropeLast(row->left);
+    while (row->parent && row == row->parent->left) row = row->parent;
+    return row->parent;
+}
+
+void editorRopeInsert(int at, erow *row) {
+    erow *l, *r;
+
+    row->left = row->right = row->parent = NULL;
+    row->prio = (unsigned int)rand();
+    row->count = row->lines;
+
+    ropeSplit(E.rows, at, &l, &r);
+    E.rows = ropeMerge(ropeMerge(l, row), r);
+    E.rows->parent = NULL;
+}
+
+// makes `at` a node boundary, cutting the span that holds it in two
+void editorRopeCut(int at) {
+    erow *l, *r;
+    ropeSplit(E.rows, at, &l, &r);
+    E.rows = ropeMerge(l, r);
+    E.rows->parent = NULL;
+}
+
+erow *editorRopeRemove(int at) {
+    erow *l, *m, *r;
+
+    ropeSplit(E.rows, at, &l, &m);
+    ropeSplit(m, 1, &m, &r);
+    E.rows = ropeMerge(l, r);
+    if (E.rows) E.rows->parent = NULL;
+
+    return m;
+}
+
+/* LOADER */
+
+/*
+ * A file bigger than LOAD_CHUNK is indexed by a loader thread, so the editor
+ * comes up at once and shows lines as they are found. The thread scans the
+ * mapping a chunk at a time into an index of its own and queues it. The main
+ * thread appends queued chunks to E.src and grows the rope by a lazy span
+ * with the new lines. This happens in editorLoadCollect, which editorReadKey
+ * calls whenever the loader's wake pipe turns readable. The last line found
+ * is held back until its end is known. The user can scroll and search the
+ * part that is loaded, but not edit it until the load is over. Esc stops the
+ * load and keeps that part, without the file name, so saving it cannot cut
+ * the file short.
+ */
+
+#define LOAD_CHUNK (8 << 20)
+
+struct loadChunk {
+    struct loadChunk *next;
+    struct editorSource idx;    // the line starts found in it, plus running counts
+    size_t end;                 // where the scan stopped
+};
+
+struct editorLoader {
+    pthread_t thread;
+    int active;                 // a load is under way
+    pthread_mutex_t lock;
+    int wake[2];
+    struct loadChunk *head, *tail;
+    int cancel;
+    int finished;               // the thread is done, by the end or by cancel
+    int failed;
+    char *map;                  // what the thread scans, fixed for the load
+    size_t size;
+    size_t collected;           // bytes of the file in E.src so far
+    int published;              // lines of E.src in the rope so far
+};
+
+struct editorLoader LOADER = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = {-1, -1},
+};
+
+void *editorLoadMain(void *arg) {
+    struct editorLoader *l = arg;
+    struct editorSource run;
+    size_t from;
+
+    memset(&run, 0, sizeof(run));
+    run.map = l->map;
+    run.size = l->size;
+
+    for (from = 0; from < run.size; from += LOAD_CHUNK) {
+        if (__atomic_load_n(&l->cancel, __ATOMIC_RELAXED)) break;
+
+        size_t to = run.size - from > LOAD_CHUNK ? from + LOAD_CHUNK : run.size;
+        struct loadChunk *c = calloc(1, sizeof(struct loadChunk));
+        c->idx = run;
+        c->end = to;
+        if (editorSourceScan(&c->idx, from, to) == -1) {
+            free(c->idx.blockoff);
+            free(c->idx.lineoff);
+            free(c);
+            pthread_mutex_lock(&l->lock);
+            l->failed = 1;
+            pthread_mutex_unlock(&l->lock);
+            break;
+        }
+        run.cr = c->idx.cr;
+        run.lf = c->idx.lf;
+        run.crlf = c->idx.crlf;
+        run.prevcr = c->idx.prevcr;
+
+        pthread_mutex_lock(&l->lock);
+        if (l->tail) l->tail->next = c;
+        else l->head = c;
+        l->tail = c;
+        pthread_mutex_unlock(&l->lock);
+        if (write(l->wake[1], "", 1) == -1) {}
+    }
+
+    pthread_mutex_lock(&l->lock);
+    l->finished = 1;
+    pthread_mutex_unlock(&l->lock);
+    if (write(l->wake[1], "", 1) == -1) {}
+    return NULL;
+}
+
+int editorLoading() {
+    return LOADER.active;
+}
+
+// readable when the loader has something for editorLoadCollect, or -1
+int editorLoadWakeFd() {
+    return LOADER.active ? LOADER.wake[0] : -1;
+}
+
+// percent of the file indexed so far
+int editorLoadProgress() {
+    return E.src.size ? (int)(LOADER.collected * 100 / E.src.size) : 100;
+}
+
+// puts lines of E.src whose end is known into the rope, as one more span
+void editorLoadPublish() {
+    struct editorLoader *l = &LOADER;
+    int known = E.src.numlines - (l->active ? 1 : 0);
+    if (known <= l->published) return;
+
+    E.rows = ropeMerge(E.rows, editorNewSpan(l->published, known - l->published));
+    E.rows->parent = NULL;
+    E.numrows += known - l->published;
+    E.edits++;
+    l->published = known;
+}
+
+// starts indexing E.src, which editorSourceOpen mapped but did not scan
+void editorLoadStart() {
+    struct editorLoader *l = &LOADER;
+
+    if (l->wake[0] == -1 && pipe2(l->wake, O_NONBLOCK | O_CLOEXEC) == -1) die("pipe2");
+    l->map = E.src.map;
+    l->size = E.src.size;
+    l->head = l->tail = NULL;
+    l->cancel = l->finished = l->failed = 0;
+    l->collected = 0;
+    l->published = 0;
+    l->active = 1;
+    if (pthread_create(&l->thread, NULL, editorLoadMain, l) != 0) die("pthread_create");
+}
+
+/*
+ * Takes the chunks the loader queued into E.src and the rope. Returns 1 if
+ * anything changed. Once the loader is finished, it is joined here.
+ */
+int editorLoadCollect() {
+    struct editorLoader *l = &LOADER;
+    if (!l->active) return 0;
+
+    char drain[64];
+    while (read(l->wake[0], drain, sizeof(drain)) > 0);
+
+    pthread_mutex_lock(&l->lock);
+    struct loadChunk *c = l->head;
+    l->head = l->tail = NULL;
+    int finished = l->finished, failed = l->failed;
+    pthread_mutex_unlock(&l->lock);
+    if (c == NULL && !finished) return 0;
+
+    struct editorSource *src = &E.src;
+    while (c) {
+        int k;
+        for (k = 0; k < c->idx.numlines; k++) {
+            size_t off = c->idx.blockoff[k / LINE_BLOCK] + c->idx.lineoff[k];
+            if (editorSourceAddLine(src, off) == -1) failed = 1;
+        }
+        src->cr = c->idx.cr;
+        src->lf = c->idx.lf;
+        src->crlf = c->idx.crlf;
+        src->prevcr = c->idx.prevcr;
+        l->collected = c->end;
+
+        struct loadChunk *next = c->next;
+        free(c->idx.blockoff);
+        free(c->idx.lineoff);
+        free(c);
+        c = next;
+    }
+
+    if (finished) {
+        pthread_join(l->thread, NULL);
+        l->active = 0;
+
+        // stopped early: the last line found is cut short, so it goes
+        if (l->collected < src->size) {
+            if (src->numlines > l->published) {
+                src->size = editorSourceOffset(src->numlines - 1);
+                src->numlines--;
+            }
+            free(src->path);
+            src->path = NULL;
+            free(E.filename);
+            E.filename = NULL;
+            editorSetStatusMessage("%s at line %d; the rest of the file is not loaded, save under a new name",
+            failed ? "Load failed" : "Load cancelled", src->numlines);
+        }
+    }
+    editorLoadPublish();
+    return 1;
+}
+
+// blocks until the load is over, for anything that needs the whole file
+void editorLoadWait() {
+    while (LOADER.active) {
+        struct pollfd pfd = { LOADER.wake[0], POLLIN, 0 };
+        poll(&pfd, 1, -1);
+        editorLoadCollect();
+    }
+}
+
+void editorLoadCancel() {
+    if (!LOADER.active) return;
+    __atomic_store_n(&LOADER.cancel, 1, __ATOMIC_RELAXED);
+    editorLoadWait();
+}
+
+// stops the loader and throws away what it found, for when E.src goes away
+void editorLoadStop() {
+    struct editorLoader *l = &LOADER;
+    if (!l->active) return;
+
+    __atomic_store_n(&l->cancel, 1, __ATOMIC_RELAXED);
+    pthread_join(l->thread, NULL);
+    l->active = 0;
+    while (l->head) {
+        struct loadChunk *c = l->head;
+        l->head = c->next;
+        free(c->idx.blockoff);
+        free(c->idx.lineoff);
+        free(c);
+    }
+    l->tail = NULL;
+}
+
+/* GAP BUFFER */
+
+/*
+ * A row's chars, and its render/hl pair, are gap buffers: the text is split
+ * around a hole left at the last edit position, so typing in the middle of a
+ * long line only moves the bytes between the previous and the current edit.
+ * A buffer holds len + gaplen + 1 bytes; the spare byte is where the '\0'
+ * goes while the gap sits at the end.
+ */
+
+#define GAP_MIN (16)
+
+void gapMove(char *b, int *gap, int gaplen, int to) {
+    if (to < *gap)
+        memmove(&b[to + gaplen], &b[to], *gap - to);
+    else if (to > *gap)
+        memmove(&b[*gap], &b[*gap + gaplen], to - *gap);
+    *gap = to;
+}
+
+// makes room for n more bytes, growing the buffer geometrically
+char *gapGrow(char *b, int len, int gap, int *gaplen, int n) {
+    if (*gaplen >= n) return b;
+
+    int newgaplen = n + len + GAP_MIN;
+    b = realloc(b, len + newgaplen + 1);
+    memmove(&b[gap + newgaplen], &b[gap + *gaplen], len - gap);
+    *gaplen = newgaplen;
+    return b;
+}
+
+void editorRowMoveGap(erow *row, int to) {
+    gapMove(row->chars, &row->gap, row->gaplen, to);
+    if (to == row->size) row->chars[to] = '\0';
+}
+
+void editorRowMoveRenderGap(erow *row, int to) {
+    int gap = row->rgap;
+    gapMove(row->render, &gap, row->rgaplen, to);
+    gapMove((char *)row->hl, &row->rgap, row->rgaplen, to);
+    if (to == row->rsize) row->render[to] = '\0';
+}
+
+char editorRowChar(erow *row, int at) {
+    return row->chars[at < row->gap ? at : at + row->gaplen];
+}
+
+// closes the gap and returns chars as a '\0' terminated string
+char *editorRowChars(erow *row) {
+    editorRowMoveGap(row, row->size);
+    return row->chars;
+}
+
+// closes the gap and returns render as a '\0' terminated string
+char *editorRowRender(erow *row) {
+    editorRowMoveRenderGap(row, row->rsize);
+    return row->render;
+}
+
+/*
+ * Makes render[from, to) contiguous, moving the gap to the nearer edge if it
+ * sits inside the range, and returns the buffer index where `from` lives.
+ */
+int editorRowRenderRange(erow *row, int from, int to) {
+    if (row->rgap >= to) return from;
+    if (row->rgap <= from) return from + row->rgaplen;
+
+    if (to - row->rgap <= row->rgap - from) {
+        editorRowMoveRenderGap(row, to);
+        return from;
+    }
+    editorRowMoveRenderGap(row, from);
+    return from + row->rgaplen;
+}
+
+// returns the index of the first c at or after from, or -1
+int editorRowFindChar(erow *row, int from, int c) {
+    char *p;
+    if (from >= row->size) return -1;
+    if (from < row->gap) {
+        p = memchr(&row->chars[from], c, row->gap - from);
+        if (p) return p - row->chars;
+        from = row->gap;
+    }
+    p = memchr(&row->chars[from + row->gaplen], c, row->size - from);
+    return p ? p - row->chars - row->gaplen : -1;
+}
+
+/* SYNTAX HIGLIGHTING */
+
+int is_separator(int c) {
+    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+#define HL_LOOKAHEAD (64)
+
+// keeps the render gap at least HL_LOOKAHEAD bytes ahead of the lexer
+void editorRowRenderReach(erow *row, int upto) {
+    if (row->rgap >= upto || row->rgap == row->rsize) return;
+
+    upto += 4 * HL_LOOKAHEAD;
+    editorRowMoveRenderGap(row, upto < row->rsize ? upto : row->rsize);
+}
+
+#define HL_SPAN_LINES (4096)
+
+/*
+ * Each syntax is compiled once into a lexer: a class table telling the
+ * highlighter what every byte can start, and a perfect hash of its keywords.
+ * Keywords are whole words, so one lookup of the word at a separator replaces
+ * trying every keyword in turn.
+ */
+
+#define LX_SEP      (1<<0)  // is_separator()
+#define LX_DIGIT    (1<<1)
+#define LX_QUOTE    (1<<2)  // opens a string
+#define LX_SCS      (1<<3)  // first byte of singleline_comment_start
+#define LX_MCS      (1<<4)  // first byte of multiline_comment_start
+#define LX_MCE      (1<<5)  // first byte of multiline_comment_end
+#define LX_KEYWORD  (1<<6)  // first byte of a keyword
+
+// bytes that end a run of plain word characters
+#define LX_BREAK    (LX_SEP | LX_QUOTE | LX_SCS | LX_MCS)
+
+struct editorKeyword {
+    const char *word;
+    int len;
+    unsigned char hl;
+};
+
+struct editorLexer {
+    unsigned char cls[256];
+    int scs_len, mcs_len, mce_len;
+    int maxkw;              // longest keyword
+    unsigned int seed, mask;
+    struct editorKeyword *slots;
+};
+
+unsigned int lexerHash(const char *s, int len, unsigned int seed) {
+    unsigned int h = seed;
+    while (len--) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+// finds a seed that gives every keyword a slot of its own
+void lexerPlaceKeywords(struct editorLexer *lx, char **keywords) {
+    int n = 0;
+    while (keywords[n]) n++;
+
+    unsigned int size = 8;
+    while (size < 2 * (unsigned int)n) size <<= 1;
+
+    for (;;) {
+        lx->slots = realloc(lx->slots, size * sizeof(struct editorKeyword));
+        lx->mask = size - 1;
+
+        for (lx->seed = 1; lx->seed <= 1024; lx->seed++) {
+            memset(lx->slots, 0, size * sizeof(struct editorKeyword));
+            int j;
+            for (j = 0; j < n; j++) {
+                int len = strlen(keywords[j]);
+                int kw2 = keywords[j][len - 1] == '|';
+                if (kw2) len--;
+                if (len == 0 || len >= HL_LOOKAHEAD) continue;
+
+                struct editorKeyword *k = &lx->slots[lexerHash(keywords[j], len, lx->seed) & lx->mask];
+                if (k->word) {
+                    // a duplicate keeps its first entry, anything else is a collision
+                    if (k->len == len && !memcmp(k->word, keywords[j], len)) continue;
+                    break;
+                }
+                k->word = keywords[j];
+                k->len = len;
+                k->hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+                if (len > lx->maxkw) lx->maxkw = len;
+                lx->cls[(unsigned char)keywords[j][0]] |= LX_KEYWORD;
+            }
+            if (j == n) return;
+        }
+        size <<= 1;
+    }
+}
+
+struct editorLexer *editorBuildLexer(struct editorSyntax *syntax) {
+    struct editorLexer *lx = calloc(1, sizeof(struct editorLexer));
+    char *scs = syntax->singleline_comment_start;
+    char *mcs = syntax->multiline_comment_start;
+    char *mce = syntax->multiline_comment_end;
+
+    lx->scs_len = scs ? strlen(scs) : 0;
+    lx->mcs_len = mcs ? strlen(mcs) : 0;
+    lx->mce_len = mce ? strlen(mce) : 0;
+    if (!lx->mcs_len || !lx->mce_len) lx->mcs_len = lx->mce_len = 0;
+
+    int c;
+    for (c = 0; c < 256; c++) {
+        if (is_separator(c)) lx->cls[c] |= LX_SEP;
+        if (isdigit(c)) lx->cls[c] |= LX_DIGIT;
+    }
+    if (syntax->flags & HL_HIGHLIGHT_STRINGS) lx->cls['"'] |= LX_QUOTE, lx->cls['\''] |= LX_QUOTE;
+    if (lx->scs_len) lx->cls[(unsigned char)scs[0]] |= LX_SCS;
+    if (lx->mcs_len) {
+        lx->cls[(unsigned char)mcs[0]] |= LX_MCS;
+        lx->cls[(unsigned char)mce[0]] |= LX_MCE;
+    }
+
+    lexerPlaceKeywords(lx, syntax->keywords);
+    return lx;
+}
+
+// the length of the keyword starting at render[i], or 0
+int lexerKeyword(struct editorLexer *lx, erow *row, int i, unsigned char *hl) {
+    char *s = &row->render[i];
+    int len = 0;
+
+    while (i + len < row->rsize && !(lx->cls[(unsigned char)s[len]] & LX_SEP))
+        if (++len > lx->maxkw) return 0;
+
+    struct editorKeyword *k = &lx->slots[lexerHash(s, len, lx->seed) & lx->mask];
+    if (k->word == NULL || k->len != len || memcmp(k->word, s, len)) return 0;
+
+    *hl = k->hl;
+    return len;
+}
+
+/*
+ * Highlights row->render starting at i, in the given multiline comment state
+ * and right after a separator. With stop >= 0 the scan ends at the first
+ * separator past stop that was already plain HL_NORMAL: the lexer is back in
+ * the state it had before the edit, so the rest of the row is unchanged.
+ * Returns the comment state at the end of the row, or -1 if it stopped early.
+ */
+int editorHighlightFrom(erow *row, int i, int in_comment, int stop) {
+    struct editorLexer *lx = E.syntax->lexer;
+
+    char *scs = E.syntax->singleline_comment_start;
+    char *mcs = E.syntax->multiline_comment_start;
+    char *mce = E.syntax->multiline_comment_end;
+    int numbers = E.syntax->flags & HL_HIGHLIGHT_NUMBERS;
+
+    int prev_sep = 1;
+    int in_string = 0;
+
+    while (i < row->rsize) {
+        editorRowRenderReach(row, i + HL_LOOKAHEAD);
+
+        // render[0, rgap) is contiguous, so runs can be taken in one go
+        char *render = row->render;
+        unsigned char *hl = row->hl;
+        unsigned char c = render[i];
+        unsigned char cls = lx->cls[c];
+
+        if (in_comment) {
+            if ((cls & LX_MCE) && !strncmp(&render[i], mce, lx->mce_len)) {
+                memset(&hl[i], HL_MLCOMMENT, lx->mce_len);
+                i += lx->mce_len;
+                in_comment = 0;
+                prev_sep = 1;
+                continue;
+            }
+            char *end = memchr(&render[i + 1], mce[0], row->rgap - i - 1);
+            int n = end ? end - &render[i] : row->rgap - i;
+            memset(&hl[i], HL_MLCOMMENT, n);
+            i += n;
+            continue;
+        }
+
+        if (in_string) {
+            hl[i] = HL_STRING;
+            if (c == '\\' && i + 1 < row->rsize) {
+                hl[i + 1] = HL_STRING;
+                i += 2;
+                continue;
+            }
+            if (c == in_string) in_string = 0;
+            i++;
+            prev_sep = 1;
+            continue;
+        }
+
+        if (cls & (LX_SCS | LX_MCS | LX_QUOTE)) {
+            if ((cls & LX_SCS) && !strncmp(&render[i], scs, lx->scs_len)) {
+                editorRowRenderReach(row, row->rsize);
+                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
+                break;
+            }
+            if ((cls & LX_MCS) && !strncmp(&render[i], mcs, lx->mcs_len)) {
+                memset(&hl[i], HL_MLCOMMENT, lx->mcs_len);
+                i += lx->mcs_len;
+                in_comment = 1;
+                continue;
+            }
+            if (cls & LX_QUOTE) {
+                in_string = c;
+                hl[i++] = HL_STRING;
+                continue;
+            }
+        }
+
+        unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
+        if (numbers && (((cls & LX_DIGIT) && (prev_sep || prev_hl == HL_NUMBER)) ||
+                        (c == '.' && prev_hl == HL_NUMBER))) {
+            hl[i++] = HL_NUMBER;
+            prev_sep = 0;
+            continue;
+        }
+
+        if (prev_sep && (cls & LX_KEYWORD)) {
+            unsigned char kw;
+            int klen = lexerKeyword(lx, row, i, &kw);
+            if (klen) {
+                memset(&hl[i], kw, klen);
+                i += klen;
+                prev_sep = 0;
+                continue;
+            }
+        }
+
+        unsigned char old_hl = hl[i];
+        hl[i++] = HL_NORMAL;
+        prev_sep = cls & LX_SEP;
+
+        if (prev_sep) {
+            if (stop >= 0 && i > stop && old_hl == HL_NORMAL) return -1;
+        } else {
+            // the rest of a word is plain up to the next separator
+            while (i < row->rgap && !(lx->cls[(unsigned char)render[i]] & LX_BREAK))
+                hl[i++] = HL_NORMAL;
+        }
+    }
+
+    return in_comment;
+}
+
+/*
+ * The comment state after a lazy span, following the rules of
+ * editorHighlightFrom without building hl. Only comments and strings can
+ * change it, so the span's bytes are scanned straight out of the mapped file
+ * and everything else is skipped. Strings and // comments end with the line.
+ */
+int editorSpanState(erow *span, int in_comment) {
+    struct editorLexer *lx = E.syntax->lexer;
+    if (lx->mcs_len == 0) return 0;
+
+    char *scs = E.syntax->singleline_comment_start;
+    char *mcs = E.syntax->multiline_comment_start;
+    char *mce = E.syntax->multiline_comment_end;
+    size_t scs_len = lx->scs_len;
+    size_t mcs_len = lx->mcs_len;
+    size_t mce_len = lx->mce_len;
+
+    char *map = E.src.map;
+    size_t i = editorSourceOffset(span->srcline);
+    size_t end = editorSourceOffset(span->srcline + span->lines);
+    int in_string = 0;
+
+    while (i < end) {
+        if (in_comment) {
+            char *p = memchr(&map[i], mce[0], end - i);
+            if (p == NULL) break;
+            i = p - map;
+            if (end - i >= mce_len && !memcmp(p, mce, mce_len)) {
+                i += mce_len;
+                in_comment = 0;
+            } else {
+                i++;
+            }
+            continue;
+        }
+
+        char c = map[i];
+        if (c == '\n') {
+            in_string = 0;
+            i++;
+        } else if (in_string) {
+            if (c == '\\' && i + 1 < end && map[i + 1] != '\n') i++;
+            else if (c == in_string) in_string = 0;
+            i++;
+        } else if (scs_len && c == scs[0] && end - i >= scs_len && !memcmp(&map[i], scs, scs_len)) {
+            char *p = memchr(&map[i], '\n', end - i);
+            i = p ? (size_t)(p - map) : end;
+        } else if (c == mcs[0] && end - i >= mcs_len && !memcmp(&map[i], mcs, mcs_len)) {
+            i += mcs_len;
+            in_comment = 1;
+        } else if (lx->cls[(unsigned char)c] & LX_QUOTE) {
+            in_string = c;
+            i++;
+        } else {
+            i++;
+            while (i < end && map[i] != '\n' &&
+                   !(lx->cls[(unsigned char)map[i]] & (LX_QUOTE | LX_SCS | LX_MCS))) i++;
+        }
+    }
+
+    return in_comment;
+}
+
+/*
+ * Rows past a changed end state are not re-highlighted here. Moving
+ * E.hlline back is enough: editorSyntaxSync redoes them once they are shown.
+ */
+void editorSetOpenComment(erow *row, int in_comment) {
+    if (row->hl_open_comment == in_comment) return;
+    row->hl_open_comment = in_comment;
+
+    int at = editorRowIndex(row) + row->lines;
+    if (at < E.hlline) E.hlline = at;
+}
+
+void editorUpdateSyntax(erow *row) {
+    if (E.syntax == NULL) {
+        editorRowRender(row);
+        memset(row->hl, HL_NORMAL, row->rsize);
+        return;
+    }
+
+    erow *prev = editorRowPrev(row);
+    row->hl_start = prev && prev->hl_open_comment;
+    editorSetOpenComment(row, editorHighlightFrom(row, 0, row->hl_start, -1));
+}
+
+/*
+ * Lexing more than HL_INLINE_BYTES at once is left to a worker thread, so
+ * opening a big file or a block comment never holds up keys. The worker gets
+ * a snapshot of the rows and spans to go through: copies of the rows' render
+ * and where the spans sit in the mapped file. It lexes each row into a fresh
+ * hl buffer. When the job is done the main thread swaps those buffers in,
+ * the only place a row's hl changes hands, so the screen shows either the
+ * previous highlighting or the new one. Every change to a node's text or
+ * extent gives it a new gen. The worker stops at the first node whose gen
+ * moved on, and its results from there on are thrown away.
+ */
+
+#define HL_INLINE_BYTES (256 << 10)
+
+struct hlItem {
+    erow *row;
+    unsigned int gen;
+    int start, end;         // comment states, as cached and then as lexed
+    int srcline, lines;     // for a span
+    char *render;           // for a row, a flat copy
+    int rsize, cap;
+    unsigned char *hl;      // the new highlighting, cap bytes like row->hl
+};
+
+struct hlJob {
+    struct hlItem *items;
+    int n, cap;
+    int done;               // items the worker got through
+    int in_comment;         // state before the first item
+    int cancel;
+    int finished;
+};
+
+struct editorHLWorker {
+    pthread_t thread;
+    int started;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct hlJob *job;
+    erow *graveyard;        // deleted rows a job may still look at
+    int wake[2];            // a byte per finished job, for editorReadKey's poll
+};
+
+struct editorHLWorker HL_worker = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .wake = {-1, -1},
+};
+
+void editorRowTouch(erow *row) {
+    static unsigned int gen;
+    if (++gen == 0) gen = 1;
+    __atomic_store_n(&row->gen, gen, __ATOMIC_RELAXED);
+}
+
+void editorHLRun(struct hlJob *job) {
+    int in_comment = job->in_comment;
+    int i;
+
+    for (i = 0; i < job->n; i++) {
+        struct hlItem *it = &job->items[i];
+        if (__atomic_load_n(&job->cancel, __ATOMIC_RELAXED) ||
+            __atomic_load_n(&it->row->gen, __ATOMIC_RELAXED) != it->gen) break;
+
+        if (it->start != in_comment) {
+            erow tmp;
+            memset(&tmp, 0, sizeof(tmp));
+            if (it->render) {
+                tmp.render = it->render;
+                tmp.rsize = tmp.rgap = it->rsize;
+                tmp.hl = it->hl = malloc(it->cap);
+                it->end = editorHighlightFrom(&tmp, 0, in_comment, -1);
+            } else {
+                tmp.srcline = it->srcline;
+                tmp.lines = it->lines;
+                it->end = editorSpanState(&tmp, in_comment);
+            }
+            it->start = in_comment;
+        }
+        in_comment = it->end;
+        job->done = i + 1;
+    }
+}
+
+void *editorHLWorkerMain(void *arg) {
+    struct editorHLWorker *w = arg;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->job == NULL || w->job->finished) pthread_cond_wait(&w->cond, &w->lock);
+
+        struct hlJob *job = w->job;
+        pthread_mutex_unlock(&w->lock);
+        editorHLRun(job);
+        pthread_mutex_lock(&w->lock);
+
+        job->finished = 1;
+        pthread_cond_broadcast(&w->cond);
+        if (write(w->wake[1], "", 1) == -1) {}
+    }
+    return NULL;
+}
+
+// snapshots the nodes from row, which starts at line at, down to upto
+void editorHLSubmit(erow *row, int at, int in_comment, int upto) {
+    struct editorHLWorker *w = &HL_worker;
+    struct hlJob *job = calloc(1, sizeof(struct hlJob));
+    job->in_comment = in_comment;
+
+    for (; row && at <= upto; row = editorRowNext(row)) {
+        if (row->lines > HL_SPAN_LINES) editorRopeCut(at + HL_SPAN_LINES);
+
+        if (job->n == job->cap) {
+            job->cap = job->cap ? job->cap * 2 : 64;
+            job->items = realloc(job->items, job->cap * sizeof(struct hlItem));
+        }
+        struct hlItem *it = &job->items[job->n++];
+        memset(it, 0, sizeof(*it));
+        it->row = row;
+        it->gen = row->gen;
+        it->start = row->hl_start;
+        it->end = row->hl_open_comment;
+        it->srcline = row->srcline;
+        it->lines = row->lines;
+        if (row->chars) {
+            char *render = editorRowRender(row);
+            it->rsize = row->rsize;
+            it->cap = row->rsize + row->rgaplen + 1;
+            it->render = malloc(row->rsize + 1);
+            memcpy(it->render, render, row->rsize + 1);
+        }
+        at += row->lines;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    if (!w->started) {
+        if (pipe2(w->wake, O_NONBLOCK | O_CLOEXEC) == -1) die("pipe2");
+        if (pthread_create(&w->thread, NULL, editorHLWorkerMain, w) != 0) die("pthread_create");
+        pthread_detach(w->thread);
+        w->started = 1;
+    }
+    w->job = job;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * Publishes what a finished job worked out, up to the first node that
+ * changed under it. Returns 1 if there was a job to collect.
+ */
+int editorSyntaxCollect() {
+    struct editorHLWorker *w = &HL_worker;
+
+    pthread_mutex_lock(&w->lock);
+    struct hlJob *job = w->job;
+    if (job == NULL || !job->finished) {
+        pthread_mutex_unlock(&w->lock);
+        return 0;
+    }
+    w->job = NULL;
+    pthread_mutex_unlock(&w->lock);
+
+    int i;
+    for (i = 0; i < job->done; i++) {
+        struct hlItem *it = &job->items[i];
+        erow *row = it->row;
+        if (row->gen != it->gen) break;
+
+        // the states may differ from what editorSyntaxSync already passed
+        if (i == 0) {
+            int at = editorRowIndex(row);
+            if (at < E.hlline) E.hlline = at;
+        }
+
+        row->hl_start = it->start;
+        row->hl_open_comment = it->end;
+        if (it->hl) {
+            editorRowMoveRenderGap(row, row->rsize);
+            free(row->hl);
+            row->hl = it->hl;
+            it->hl = NULL;
+        }
+    }
+
+    for (i = 0; i < job->n; i++) {
+        free(job->items[i].render);
+        free(job->items[i].hl);
+    }
+    free(job->items);
+    free(job);
+
+    while (w->graveyard) {
+        erow *row = w->graveyard;
+        w->graveyard = row->right;
+        free(row);
+    }
+    return 1;
+}
+
+// readable when a job has finished, -1 before the worker has started
+int editorSyntaxWakeFd() {
+    return HL_worker.wake[0];
+}
+
+// stops the worker before anything it reads goes away, keeping what it did
+void editorSyntaxCancel() {
+    struct editorHLWorker *w = &HL_worker;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->job) {
+        __atomic_store_n(&w->job->cancel, 1, __ATOMIC_RELAXED);
+        while (!w->job->finished) pthread_cond_wait(&w->cond, &w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+    editorSyntaxCollect();
+}
+
+// frees a deleted row once no job can be looking at it
+void editorSyntaxRetire(erow *row) {
+    struct editorHLWorker *w = &HL_worker;
+
+    __atomic_store_n(&row->gen, 0, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&w->lock);
+    if (w->job) {
+        row->right = w->graveyard;
+        w->graveyard = row;
+        row = NULL;
+    }
+    pthread_mutex_unlock(&w->lock);
+    free(row);
+}
+
+/*
+ * Brings highlighting up to date down to row `upto`, walking forwards from
+ * E.hlline. A row or span is only lexed again when the state it starts in is
+ * not the one it was lexed from, so the walk settles down to checking one
+ * int per node as soon as an end state matches its cached value. Long spans
+ * are cut into HL_SPAN_LINES pieces on the way, so loading a line from one
+ * later only has to rescan its own piece. With background set, whatever is
+ * left after HL_INLINE_BYTES is handed to the worker.
+ */
+void editorSyntaxSync(int upto, int background) {
+    if (E.syntax == NULL || E.hlline > upto) return;
+    if (!background) editorSyntaxCancel();
+
+    int off;
+    erow *row = ropeFind(E.hlline, &off);
+    if (row == NULL) return;
+    E.hlline -= off;
+
+    erow *prev = editorRowPrev(row);
+    int in_comment = prev && prev->hl_open_comment;
+    size_t budget = HL_INLINE_BYTES;
+
+    for (; row && E.hlline <= upto; row = editorRowNext(row)) {
+        if (row->hl_start != in_comment) {
+            if (row->lines > HL_SPAN_LINES) editorRopeCut(E.hlline + HL_SPAN_LINES);
+
+            size_t cost = row->chars ? (size_t)row->rsize :
+                editorSourceOffset(row->srcline + row->lines) - editorSourceOffset(row->srcline);
+            if (background && cost > budget) {
+                if (HL_worker.job == NULL) editorHLSubmit(row, E.hlline, in_comment, upto);
+                return;
+            }
+            if (background) budget -= cost;
+
+            row->hl_start = in_comment;
+            if (row->chars)
+                row->hl_open_comment = editorHighlightFrom(row, 0, in_comment, -1);
+            else
+                row->hl_open_comment = editorSpanState(row, in_comment);
+        }
+        in_comment = row->hl_open_comment;
+        E.hlline += row->lines;
+    }
+}
+
+/*
+ * Re-highlights a row after render[from, to) was edited. Lexing restarts just
+ * after the last plain separator before the edit and stops once it is back in
+ * step with the old highlighting, so only the affected span is rescanned.
+ */
+void editorUpdateSyntaxSpan(erow *row, int from, int to) {
+    if (E.syntax == NULL) return;
+
+    // back off far enough not to restart inside a comment delimiter
+    char *scs = E.syntax->singleline_comment_start;
+    char *mcs = E.syntax->multiline_comment_start;
+    int back = scs ? strlen(scs) : 0;
+    if (mcs && (int)strlen(mcs) > back) back = strlen(mcs);
+
+    int k = from;
+    if (back > 1) k -= back - 1;
+    if (k < 0) k = 0;
+    while (k > 0 && !(row->hl[k - 1] == HL_NORMAL && is_separator(row->render[k - 1])))
+        k--;
+
+    // the rest of hl was lexed from hl_start, so restart in step with it
+    int in_comment = (k == 0 && row->hl_start == 1);
+
+    in_comment = editorHighlightFrom(row, k, in_comment, to);
+    if (in_comment != -1) editorSetOpenComment(row, in_comment);
+}
+
+int editorSyntaxToColor(int hl) {
+    switch (hl) {
+        case HL_KEYWORD1: return HL_config.KeywordColor;
+        case HL_KEYWORD2: return HL_config.VariableColor;
+        case HL_COMMENT: return HL_config.CommentColor;
+        case HL_MLCOMMENT: return HL_config.MultilineCommentColor;
+        case HL_STRING: return HL_config.StringColor;
+        case HL_NUMBER: return HL_config.NumberColor;
+        case HL_MATCH: return HL_config.MatchColor;
+        default: return HL_config.DefaultColor;
+    }
+}
+
+void editorSelectSyntaxHighlight() {
+    editorSyntaxCancel();
+    E.syntax = NULL;
+    
+    if (E.filename == NULL) return;
+    
+    char *ext = strrchr(E.filename, '.');
+    
+    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+        struct editorSyntax *s = &HLDB[j];
+        unsigned int i = 0;
+        
+        while (s->filematch[i]) {
+            int is_ext = (s->filematch[i][0] == '.');
+            
+            if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+                (!is_ext && strstr(E.filename, s->filematch[i]))) {
+                E.syntax = s;
+                if (s->lexer == NULL) s->lexer = editorBuildLexer(s);
+
+                // rows are re-highlighted as they come into view
+                erow *row;
+                for (row = ropeFirst(E.rows); row; row = editorRowNext(row))
+                    row->hl_start = -1;
+                E.hlline = 0;
+
+                return;
+            }
+            i++;
+        }
+    }
+}
+
+/* row operations */
+
+/*
+ * A row with tabs keeps an index of them: for each tab, where it is in chars
+ * and the render column just after it. Between two tabs a column is one
+ * byte, so a binary search over the index maps either way. The index is
+ * filled in from the left only as far as a lookup needs. An edit at chars[at]
+ * drops the entries from there on, as the tabs before it are where they were.
+ */
+
+// drops the tab index entries for tabs at chars[at] and after
+void editorRowTabsFrom(erow *row, int at) {
+    while (row->tabsknown > 0 && row->tabidx[row->tabsknown * 2 - 2] >= at) row->tabsknown--;
+}
+
+// fills in the tab index until it has `want` in it, or all the row's tabs
+static const int *editorRowTabs(erow *row, int want, int rx) {
+    if (row->tabcap < row->tabs) {
+        row->tabcap = row->tabs;
+        row->tabidx = realloc(row->tabidx, 2 * row->tabcap * sizeof(int));
+        if (row->tabidx == NULL) die("realloc");
+    }
+
+    int n = row->tabsknown, t;
+    int at = n ? row->tabidx[n * 2 - 2] + 1 : 0;
+    int col = n ? row->tabidx[n * 2 - 1] : 0;
+    while (n < row->tabs && (n == 0 || (rx ? col : at - 1) < want) &&
+        (t = editorRowFindChar(row, at, '\t')) != -1) {
+        col += t - at;
+        col += HL_config.TabStop - col % HL_config.TabStop;
+        row->tabidx[n * 2] = t;
+        row->tabidx[n * 2 + 1] = col;
+        at = t + 1;
+        n++;
+    }
+    row->tabsknown = n;
+    return row->tabidx;
+}
+
+// render column of chars[cx], with columns past the end one byte each
+int editorRowCxToRx(erow *row, int cx) {
+    if (row->tabs == 0) return cx;
+
+    // the tabs before cx
+    const int *tab = editorRowTabs(row, cx, 0);
+    int lo = 0, hi = row->tabsknown;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (tab[mid * 2] < cx) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0) return cx;
+    return tab[lo * 2 - 1] + cx - tab[lo * 2 - 2] - 1;
+}
+
+// the index in chars of what is drawn at render column rx
+int editorRowRxToCx(erow *row, int rx) {
+    if (row->tabs == 0) return rx < row->size ? rx : row->size;
+
+    // the tabs that end at or before rx
+    const int *tab = editorRowTabs(row, rx + 1, 1);
+    int lo = 0, hi = row->tabsknown;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (tab[mid * 2 + 1] <= rx) lo = mid + 1;
+        else hi = mid;
+    }
+    int cx = lo ? tab[lo * 2 - 2] + 1 + rx - tab[lo * 2 - 1] : rx;
+    if (lo < row->tabsknown && cx > tab[lo * 2]) cx = tab[lo * 2];
+    return cx < row->size ? cx : row->size;
+}
+
+void editorRenderRow(erow *row) {
+    char *chars = editorRowChars(row);
+    int tabs = 0;
+    int j;
+    for (j = 0; j < row->size; j++)
+        if(chars[j] == '\t')  tabs++;
+
+    free(row->render);
+    row->render = malloc(row->size + tabs*(HL_config.TabStop-1) + 1);
+
+    int idx = 0;
+    for (j = 0; j < row->size; j++) {
+        if (chars[j] == '\t'){
+            row->render[idx++] = ' ';
+            while(idx % HL_config.TabStop != 0) row->render[idx++] = ' ';
+        }else{
+            row->render[idx++] = chars[j];
+        }
+    }
+
+    row->render[idx] = '\0';
+    row->rsize = idx;
+    row->rgap = idx;
+    row->rgaplen = 0;
+    row->hl = realloc(row->hl, idx + 1);
+    row->tabs = tabs;
+    row->tabsknown = 0;
+    editorRowTouch(row);
+}
+
+void editorUpdateRow(erow *row) {
+    editorRenderRow(row);
+    editorUpdateSyntax(row);
+}
+
+// inserts n copies of c at render column rx, highlighted as HL_NORMAL
+void editorRowRenderInsert(erow *row, int rx, int c, int n) {
+    int gaplen = row->rgaplen;
+    editorRowMoveRenderGap(row, rx);
+    row->render = gapGrow(row->render, row->rsize, row->rgap, &gaplen, n);
+    row->hl = (unsigned char *)gapGrow((char *)row->hl, row->rsize, row->rgap, &row->rgaplen, n);
+
+    memset(&row->render[rx], c, n);
+    memset(&row->hl[rx], HL_NORMAL, n);
+    row->rgap += n;
+    row->rgaplen -= n;
+    row->rsize += n;
+    if (row->rgap == row->rsize) row->render[row->rsize] = '\0';
+    editorRowTouch(row);
+}
+
+void editorRowRenderDelete(erow *row, int rx, int n) {
+    editorRowMoveRenderGap(row, rx);
+    row->rgaplen += n;
+    row->rsize -= n;
+    if (row->rgap == row->rsize) row->render[row->rsize] = '\0';
+    editorRowTouch(row);
+}
+
+/*
+ * After an edit at chars[cx] (now rendered at column rx) shifted the rest of
+ * the row by `shift` columns, only the next tab can change width; everything
+ * past it lands on the same tab stops as before and is left untouched.
+ */
+void editorRowRetab(erow *row, int cx, int rx, int shift) {
+    if (row->tabs == 0) return;
+
+    int t = editorRowFindChar(row, cx, '\t');
+    if (t == -1) return;
+
+    int col = rx + (t - cx);
+    int old_w = HL_config.TabStop - (col - shift) % HL_config.TabStop;
+    int new_w = HL_config.TabStop - col % HL_config.TabStop;
+
+    if (new_w > old_w) {
+        int p = editorRowRenderRange(row, col, col + 1);
+        unsigned char hl = row->hl[p];
+        editorRowRenderInsert(row, col, ' ', new_w - old_w);
+        memset(&row->hl[col], hl, new_w - old_w);
+    } else if (new_w < old_w) {
+        editorRowRenderDelete(row, col, old_w - new_w);
+    }
+}
+
+void editorRowInit(erow *row, char *s, size_t len) {
+    char *chars = malloc(len + 1);
+    memcpy(chars, s, len);
+    editorRowAdopt(row, chars, len);
+}
+
+// makes s[0, len) the text of a row with no render yet; s is its to free, with room for a '\0'
+void editorRowAdopt(erow *row, char *s, int len) {
+    row->size = len;
+    row->chars = s;
+    row->chars[len] = '\0';
+    row->gap = len;
+    row->gaplen = 0;
+
+    row->rsize = 0;
+    row->render = NULL;
+    row->hl = NULL;
+    row->tabidx = NULL;
+    row->tabs = row->tabsknown = row->tabcap = 0;
+    row->hl_open_comment = 0;
+    row->hl_start = -1;
+    row->lines = 1;
+    editorRowTouch(row);
+}
+
+// cuts row `at`, `off` lines into a lazy span, out into a node of its own
+static erow *editorRowIsolate(int at, int off) {
+    // the span's cached state no longer covers what is left of it
+    if (at - off < E.hlline) E.hlline = at - off;
+
+    erow *l, *row, *r;
+    ropeSplit(E.rows, at, &l, &row);
+    ropeSplit(row, 1, &row, &r);
+    E.rows = ropeMerge(ropeMerge(l, row), r);
+    E.rows->parent = NULL;
+    return row;
+}
+
+// returns row `at`, loading it from the mapped file if it is still lazy
+erow *editorRowAt(int at) {
+    int off;
+    erow *row = ropeFind(at, &off);
+    if (row == NULL || row->chars) return row;
+
+    row = editorRowIsolate(at, off);
+    int len;
+    char *s = editorSourceLine(row->srcline, &len);
+    editorRowInit(row, s, len);
+
+    // highlighted later by editorSyntaxSync, if it is ever shown
+    editorRenderRow(row);
+    memset(row->hl, HL_NORMAL, row->rsize);
+    row->hl_start = -1;
+    return row;
+}
+
+// rows before E.dirtyrow are left alone by editorWriteChanges
+void editorRowDirty(int at) {
+    if (at < E.dirtyrow) E.dirtyrow = at;
+    if (at < E.hlline) E.hlline = at;
+    E.dirty++;
+    E.edits++;
+}
+
+/*
+ * Gives row `at` the text s[0, len) in place of its own, taking s over,
+ * with no copy. Like any edit it is highlighted again by editorSyntaxSync.
+ */
+void editorRowReplace(int at, char *s, int len) {
+    int off;
+    erow *row = ropeFind(at, &off);
+    if (row->chars) {
+        free(row->chars);
+        free(row->render);
+        free(row->hl);
+        free(row->tabidx);
+    } else {
+        row = editorRowIsolate(at, off);
+    }
+    editorRowAdopt(row, s, len);
+    editorRenderRow(row);
+    memset(row->hl, HL_NORMAL, row->rsize);
+    editorRowDirty(at);
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+    if (at < 0 || at > E.numrows) return;
+    
+    erow *row = malloc(sizeof(erow));
+    editorRowInit(row, s, len);
+    row->srcline = -1;
+
+    editorRopeInsert(at, row);
+    E.numrows++;
+
+    editorUpdateRow(row);
+
+    editorRowDirty(at);
+}
+
+void editorFreeRow(erow *row) {
+    free(row->render);
+    free(row->chars);
+    free(row->hl);
+    free(row->tabidx);
+}
+
+void editorDelRow(int at) {
+    if (at < 0 || at >= E.numrows) return;
+    editorRowAt(at);
+    erow *row = editorRopeRemove(at);
+    E.numrows--;
+
+    editorFreeRow(row);
+    editorSyntaxRetire(row);
+    editorRowDirty(at);
+}
+
+static void ropeFree(erow *t) {
+    if (t == NULL) return;
+    ropeFree(t->left);
+    ropeFree(t->right);
+    editorFreeRow(t);
+    free(t);
+}
+
+// empties the buffer, for loading a file into it again
+void editorFreeRows() {
+    editorSyntaxCancel();
+    ropeFree(E.rows);
+    E.rows = NULL;
+    E.numrows = 0;
+    E.hlline = 0;
+    E.edits++;
+}
+
+void editorRowInsertChar(erow *row, int at, int c) {
+    at -= HL_config.LineNumberMargin;
+    if (at < 0 || at > row->size) at = row->size;
+    
+    int rx = editorRowCxToRx(row, at);
+
+    editorRowMoveGap(row, at);
+    row->chars = gapGrow(row->chars, row->size, row->gap, &row->gaplen, 1);
+    row->chars[row->gap++] = c;
+    row->gaplen--;
+    row->size++;
+    if (row->gap == row->size) row->chars[row->size] = '\0';
+    editorRowTabsFrom(row, at);
+
+    int w = 1;
+    if (c == '\t') {
+        row->tabs++;
+        w = HL_config.TabStop - rx % HL_config.TabStop;
+        c = ' ';
+    }
+    
+    editorRowRenderInsert(row, rx, c, w);
+    editorRowRetab(row, at + 1, rx + w, w);
+    editorUpdateSyntaxSpan(row, rx, rx + w);
+    editorRowDirty(editorRowIndex(row));
+}
+
+void editorRowInsertString(erow *row, int at, const char *s, size_t len) {
+    editorRowMoveGap(row, at);
+    row->chars = gapGrow(row->chars, row->size, row->gap, &row->gaplen, len);
+    memcpy(&row->chars[row->gap], s, len);
+    row->gap += len;
+    row->gaplen -= len;
     row->size += len;
-    row->chars[row->size] = '\0';
+    if (row->gap == row->size) row->chars[row->size] = '\0';
     editorUpdateRow(row);
-    E.dirty++;
+    editorRowDirty(editorRowIndex(row));
+}
+
+void editorRowDeleteString(erow *row, int at, size_t len) {
+    editorRowMoveGap(row, at);
+    row->gaplen += len;
+    row->size -= len;
+    if (row->gap == row->size) row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+    editorRowDirty(editorRowIndex(row));
+}
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+    editorRowInsertString(row, row->size, s, len);
+}
+
+void editorRowDelChar(erow *row, int at) {
+    at -= HL_config.LineNumberMargin;
+    if (at < 0 || at >= row->size) return;
+    
+    int rx = editorRowCxToRx(row, at);
+    char c = editorRowChar(row, at);
+
+    editorRowMoveGap(row, at);
+    row->gaplen++;
+    row->size--;
+    if (row->gap == row->size) row->chars[row->size] = '\0';
+    editorRowTabsFrom(row, at);
+
+    int w = 1;
+    if (c == '\t') {
+        row->tabs--;
+        w = HL_config.TabStop - rx % HL_config.TabStop;
+    }
+
+    editorRowRenderDelete(row, rx, w);
+    editorRowRetab(row, at, rx, -w);
+    editorUpdateSyntaxSpan(row, rx, rx);
+    editorRowDirty(editorRowIndex(row));
+}
+
+/* EDITOR OPERATIONS */
+
+void editorInsertChar(int c) {
+    char ch = c;
+    editorUndoRecord(UNDO_INSERT, E.cy, E.cx - HL_config.LineNumberMargin, &ch, 1,
+    E.cy == E.numrows ? UNDO_NEWROW : 0);
+
+    if (E.cy == E.numrows) {
+        editorInsertRow(E.numrows, "", 0);
+    }
+    
+    editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
+    E.cx++;
+}
+
+void editorInsertNewline() {
+    if (E.cy == E.numrows)
+        editorUndoRecord(UNDO_INSERT, E.cy, 0, "", 0, UNDO_NEWROW);
+    else
+        editorUndoRecord(UNDO_INSERT, E.cy, E.cx - HL_config.LineNumberMargin, "\n", 1, 0);
+
+    if (E.cx == HL_config.LineNumberMargin) {
+        editorInsertRow(E.cy, "", 0);
+    } else {
+        erow *row = editorRowAt(E.cy);
+        char *chars = editorRowChars(row);
+        editorInsertRow(E.cy + 1, &chars[E.cx - HL_config.LineNumberMargin], row->size - E.cx + HL_config.LineNumberMargin);
+        row->gaplen += row->size - (E.cx - HL_config.LineNumberMargin);
+        row->size = E.cx - HL_config.LineNumberMargin;
+        row->gap = row->size;
+        row->chars[row->size] = '\0';
+        editorUpdateRow(row);
+        editorRowDirty(E.cy);
+    }
+    E.cy++;
+    E.cx = HL_config.LineNumberMargin;
+}
+
+// length of the line at the start of s, and in *eol that of its line break
+static size_t editorTextLine(const char *s, size_t len, size_t *eol) {
+    const char *nl = memchr(s, '\n', len);
+    size_t n = nl ? (size_t)(nl - s) : len;
+
+    *eol = nl != NULL;
+    return n;
+}
+
+/*
+ * Inserts text at the cursor exactly as given: tabs stay tabs, and nothing is
+ * indented. Lines are broken at '\n' only. The first line joins the cursor's row. The other lines become new
+ * rows, which go into the rope in one split and merge. They are rendered here
+ * but not lexed. The next editorSyntaxSync lexes them once, from the cursor's
+ * row on.
+ */
+void editorInsertText(const char *s, size_t len) {
+    if (len == 0) return;
+    int newrow = E.cy == E.numrows;
+    if (newrow) editorInsertRow(E.numrows, "", 0);
+
+    erow *row = editorRowAt(E.cy);
+    int at = E.cx - HL_config.LineNumberMargin;
+    if (at < 0 || at > row->size) at = row->size;
+    editorUndoRecord(UNDO_INSERT, E.cy, at, s, len, newrow ? UNDO_NEWROW : 0);
+
+    size_t eol;
+    size_t n = editorTextLine(s, len, &eol);
+    if (eol == 0) {
+        editorRowInsertString(row, at, s, n);
+        E.cx = at + n + HL_config.LineNumberMargin;
+        return;
+    }
+
+    // cut the row at the cursor; what followed goes after the last line
+    char *chars = editorRowChars(row);
+    size_t taillen = row->size - at;
+    char *tail = malloc(taillen);
+    memcpy(tail, &chars[at], taillen);
+    row->gaplen += taillen;
+    row->size = at;
+    row->gap = at;
+    row->chars[at] = '\0';
+    editorRowInsertString(row, at, s, n);
+    s += n + eol;
+    len -= n + eol;
+
+    erow *rows = NULL;
+    int added = 0;
+    for (;;) {
+        n = editorTextLine(s, len, &eol);
+
+        erow *r = malloc(sizeof(erow));
+        if (eol) {
+            editorRowInit(r, (char *)s, n);
+        } else {
+            char *last = malloc(n + taillen);
+            memcpy(last, s, n);
+            memcpy(last + n, tail, taillen);
+            editorRowInit(r, last, n + taillen);
+            free(last);
+        }
+        r->srcline = -1;
+        editorRenderRow(r);
+        memset(r->hl, HL_NORMAL, r->rsize);
+
+        r->left = r->right = r->parent = NULL;
+        r->prio = (unsigned int)rand();
+        r->count = 1;
+        rows = ropeMerge(rows, r);
+        added++;
+
+        s += n + eol;
+        len -= n + eol;
+        if (eol == 0) break;
+    }
+    free(tail);
+
+    erow *l, *r;
+    ropeSplit(E.rows, E.cy + 1, &l, &r);
+    E.rows = ropeMerge(ropeMerge(l, rows), r);
+    E.rows->parent = NULL;
+    E.numrows += added;
+
+    E.cy += added;
+    E.cx = n + HL_config.LineNumberMargin;
+    editorRowDirty(E.cy - added + 1);
+}
+
+void editorInsertTab(){
+    int space_num;
+    if ((E.cx - HL_config.LineNumberMargin) % HL_config.TabStop == 0){
+        space_num = HL_config.TabStop ;
+    }else{
+        space_num = HL_config.TabStop  - ((E.cx - HL_config.LineNumberMargin) % HL_config.TabStop );
+    }
+
+    int i;
+    for (i = 0; i < space_num; i++){
+        editorInsertChar(' ');
+    }
+    
+}
+
+void editorDelChar() {
+    if (E.cy == E.numrows) return;
+    if (E.cx == HL_config.LineNumberMargin && E.cy == 0) return;
+    
+    erow *row = editorRowAt(E.cy);
+    if (E.cx > HL_config.LineNumberMargin) {
+        char c = editorRowChar(row, E.cx - 1 - HL_config.LineNumberMargin);
+        editorUndoRecord(UNDO_DELETE, E.cy, E.cx - 1 - HL_config.LineNumberMargin, &c, 1, 0);
+        editorRowDelChar(row, E.cx - 1);
+        E.cx--;
+    }else if(E.cx == HL_config.LineNumberMargin){
+        erow *prev = editorRowAt(E.cy - 1);
+        editorUndoRecord(UNDO_DELETE, E.cy - 1, prev->size, "\n", 1, 0);
+        E.cx = prev->size + HL_config.LineNumberMargin;
+        editorRowAppendString(prev, editorRowChars(row), row->size);
+        editorDelRow(E.cy);
+        E.cy--;
+  }
+}
+
+/* UNDO */
+
+/*
+ * Undo keeps a log of what was inserted and deleted, and where, as (row,
+ * column) pairs. The row store has no byte offsets, so this is its version
+ * of one. Records are appended to a chain of chunks and never move. Undoing
+ * goes back along prev, and redoing goes forward along next. A new edit
+ * drops whatever had been undone. A run of typing, or of backspacing, grows
+ * the last record in place instead of adding one per key. Once the log holds
+ * more than UNDO_MAX_BYTES, its oldest chunks are freed. Replaying a record
+ * goes through the same row primitives the edit used, so it costs the size
+ * of the edit, not of the file.
+ */
+
+#define UNDO_CHUNK (64 << 10)
+#define UNDO_MAX_BYTES (64 << 20)
+#define UNDO_COALESCE_MAX (4096)    // longest run of typing in one record
+
+static size_t undoRecSize(int len) {
+    return (sizeof(struct undoRec) + len + 7) & ~(size_t)7;
+}
+
+// the chunk at the end of the log, with room for a record of len bytes
+static struct undoChunk *undoRoom(int len) {
+    struct editorUndo *u = &E.undo;
+    size_t need = undoRecSize(len);
+    struct undoChunk *c = u->last;
+
+    if (c == NULL || c->used + need > c->cap) {
+        size_t cap = need > UNDO_CHUNK ? need : UNDO_CHUNK;
+        c = malloc(sizeof(struct undoChunk) + cap);
+        if (c == NULL) die("malloc");
+        c->used = 0;
+        c->cap = cap;
+        c->next = NULL;
+        c->prev = u->last;
+        if (u->last) u->last->next = c;
+        else u->first = c;
+        u->last = c;
+        u->bytes += cap;
+    }
+    return c;
+}
+
+// forgets the records after u->cur, which were undone
+static void undoDropRedo() {
+    struct editorUndo *u = &E.undo;
+    if (u->top == u->cur) return;
+
+    while (u->last) {
+        struct undoChunk *c = u->last;
+        char *end = u->cur ? (char *)u->cur + undoRecSize(u->cur->len) : NULL;
+        if (end && end > c->data && end <= c->data + c->used) {
+            c->used = end - c->data;
+            break;
+        }
+        u->last = c->prev;
+        if (u->last) u->last->next = NULL;
+        else u->first = NULL;
+        u->bytes -= c->cap;
+        free(c);
+    }
+    if (u->cur) u->cur->next = NULL;
+    u->top = u->cur;
+}
+
+// keeps the log under UNDO_MAX_BYTES by letting go of its oldest chunks
+static void undoTrim() {
+    struct editorUndo *u = &E.undo;
+
+    while (u->bytes > UNDO_MAX_BYTES && u->first && u->first != u->last) {
+        struct undoChunk *c = u->first;
+        char *cur = (char *)u->cur;
+        if (cur >= c->data && cur < c->data + c->used) break;
+
+        struct undoRec *oldest = (struct undoRec *)c->next->data;
+        oldest->prev = NULL;
+        u->first = c->next;
+        u->first->prev = NULL;
+        u->bytes -= c->cap;
+        free(c);
+    }
+}
+
+static int undoHasNewline(const char *s, int len) {
+    return memchr(s, '\n', len) != NULL;
+}
+
+void editorUndoRecord(int type, int y, int x, const char *s, int len, int flags) {
+    struct editorUndo *u = &E.undo;
+    if (u->applying) return;
+
+    editorJournalAppend(type, y, x, s, len, flags);
+    undoDropRedo();
+
+    // one more key of a run of typing or backspacing
+    struct undoRec *last = u->cur;
+    if (last && last->type == type && !flags && !last->flags && last->group == u->group &&
+        last->y == y && last->len + len <= UNDO_COALESCE_MAX &&
+        !undoHasNewline(s, len) && !undoHasNewline(last->text, last->len)) {
+
+        char *end = (char *)last + undoRecSize(last->len);
+        struct undoChunk *c = u->last;
+        size_t grow = undoRecSize(last->len + len) - undoRecSize(last->len);
+        int fits = end == c->data + c->used && c->used + grow <= c->cap;
+
+        if (fits && type == UNDO_INSERT && x == last->x + last->len) {
+            memcpy(last->text + last->len, s, len);
+            last->len += len;
+            c->used += grow;
+            return;
+        }
+        if (fits && type == UNDO_DELETE && x == last->x) {
+            // Del, taking the text after the cursor
+            memcpy(last->text + last->len, s, len);
+            last->len += len;
+            c->used += grow;
+            return;
+        }
+        if (fits && type == UNDO_DELETE && x + len == last->x) {
+            memmove(last->text + len, last->text, last->len);
+            memcpy(last->text, s, len);
+            last->len += len;
+            last->x = x;
+            c->used += grow;
+            return;
+        }
+    }
+
+    struct undoChunk *c = undoRoom(len);
+    struct undoRec *rec = (struct undoRec *)(c->data + c->used);
+    c->used += undoRecSize(len);
+
+    rec->prev = u->cur;
+    rec->next = NULL;
+    if (u->cur) u->cur->next = rec;
+    rec->type = type;
+    rec->flags = flags;
+    rec->group = u->group;
+    rec->y = y;
+    rec->x = x;
+    rec->len = len;
+    memcpy(rec->text, s, len);
+    u->cur = u->top = rec;
+
+    undoTrim();
+}
+
+// records made until editorUndoEnd are undone and redone together
+void editorUndoBegin() {
+    static unsigned int group;
+    if (++group == 0) group = 1;
+    E.undo.group = group;
+}
+
+void editorUndoEnd() {
+    E.undo.group = 0;
+}
+
+// deletes len bytes of text, line breaks counted as one, from (y, x) on
+void editorDeleteText(int y, int x, const char *s, int len) {
+    int lines = 0, lastlen = len;
+    int i;
+    for (i = 0; i < len; i++) {
+        if (s[i] == '\n') {
+            lines++;
+            lastlen = len - i - 1;
+        }
+    }
+
+    erow *row = editorRowAt(y);
+    if (lines == 0) {
+        editorRowDeleteString(row, x, len);
+        return;
+    }
+
+    erow *last = editorRowAt(y + lines);
+    char *chars = editorRowChars(last);
+    int restlen = last->size - lastlen;
+    char *rest = malloc(restlen + 1);
+    memcpy(rest, &chars[lastlen], restlen);
+
+    for (i = 0; i < lines; i++) editorDelRow(y + 1);
+
+    row = editorRowAt(y);
+    editorRowDeleteString(row, x, row->size - x);
+    editorRowInsertString(row, x, rest, restlen);
+    free(rest);
+}
+
+// makes an edit described by a record, leaving the cursor after it
+void editorApplyEdit(int type, int y, int x, const char *s, int len, int flags) {
+    if (type == UNDO_INSERT) {
+        if (flags & UNDO_NEWROW) editorInsertRow(y, "", 0);
+        E.cy = y;
+        E.cx = x + HL_config.LineNumberMargin;
+        editorInsertText(s, len);
+    } else {
+        editorDeleteText(y, x, s, len);
+        if (flags & UNDO_NEWROW) editorDelRow(y);
+        E.cy = y;
+        E.cx = x + HL_config.LineNumberMargin;
+    }
+}
+
+/*
+ * Whether a record from outside, such as the journal, fits the buffer. A
+ * delete must name text that is there, line breaks and all; one that made
+ * its row must also take everything left in it.
+ */
+int editorEditValid(int type, int y, int x, const char *s, int len, int flags) {
+    if (type != UNDO_INSERT && type != UNDO_DELETE) return 0;
+    if (len < 0 || y < 0 || x < 0) return 0;
+    if (type == UNDO_INSERT && (flags & UNDO_NEWROW)) return y == E.numrows && x == 0;
+    if (y >= E.numrows || x > editorRowAt(y)->size) return 0;
+    if (type == UNDO_INSERT) return 1;
+    if ((flags & UNDO_NEWROW) && x != 0) return 0;
+
+    // each line of s against the row it comes out of
+    int i = 0;
+    for (;;) {
+        erow *row = editorRowAt(y);
+        const char *nl = memchr(&s[i], '\n', len - i);
+        int seg = (nl ? nl - s : len) - i;
+        if (x + seg > row->size || memcmp(&editorRowChars(row)[x], &s[i], seg) != 0) return 0;
+        if (nl ? x + seg != row->size : (flags & UNDO_NEWROW) && x + seg != row->size) return 0;
+        if (nl == NULL) return 1;
+
+        i += seg + 1;
+        x = 0;
+        if (++y >= E.numrows) return 0;
+    }
+}
+
+static void undoApply(struct undoRec *rec, int undo) {
+    int insert = (rec->type == UNDO_INSERT) != undo;
+    int type = insert ? UNDO_INSERT : UNDO_DELETE;
+
+    editorJournalAppend(type, rec->y, rec->x, rec->text, rec->len, rec->flags);
+    editorApplyEdit(type, rec->y, rec->x, rec->text, rec->len, rec->flags);
+    if (undo) {
+        E.cy = rec->y;
+        E.cx = rec->x + HL_config.LineNumberMargin;
+    }
+}
+
+void editorUndo() {
+    struct editorUndo *u = &E.undo;
+    if (u->cur == NULL) {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+
+    u->applying = 1;
+    unsigned int group = u->cur->group;
+    do {
+        undoApply(u->cur, 1);
+        u->cur = u->cur->prev;
+    } while (group && u->cur && u->cur->group == group);
+    u->applying = 0;
+}
+
+void editorRedo() {
+    struct editorUndo *u = &E.undo;
+    struct undoRec *next = u->cur ? u->cur->next : (u->first ? (struct undoRec *)u->first->data : NULL);
+    if (next == NULL || (u->cur == NULL && u->top == NULL)) {
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+
+    u->applying = 1;
+    unsigned int group = next->group;
+    do {
+        undoApply(next, 0);
+        u->cur = next;
+        next = next->next;
+    } while (group && next && next->group == group);
+    u->applying = 0;
+}
+
+/*  FILE I/O */
+
+/*
+ * Maps the file that was just written in place of the one backing the lazy
+ * spans. Its lines are exactly the rows of the buffer, so every node now
+ * starts at the file line equal to its row index.
+ */
+void editorSourceRemap(int fd) {
+    struct stat st;
+
+    if (fstat(fd, &st) == -1) die("fstat");
+    if (editorSourceOpen(fd, st.st_size) == -1) die("mmap");
+
+    int at = 0;
+    erow *row;
+    for (row = ropeFirst(E.rows); row; row = editorRowNext(row)) {
+        row->srcline = at;
+        at += row->lines;
+    }
+}
+
+/*
+ * Saving streams the rows straight out of the rope and the mapped file in
+ * writev batches, so the document is never copied into a second buffer.
+ */
+
+#define SAVE_BATCH (1024)
+
+struct saveStream {
+    int fd;
+    struct iovec iov[SAVE_BATCH];
+    int n;
+    size_t written;
+};
+
+int saveFlush(struct saveStream *ss) {
+    struct iovec *iov = ss->iov;
+    int n = ss->n;
+
+    while (n > 0) {
+        ssize_t w = writev(ss->fd, iov, n);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        ss->written += w;
+
+        // skip what went out, possibly stopping inside an iovec
+        while (n > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+
+    ss->n = 0;
+    return 0;
+}
+
+int saveAppend(struct saveStream *ss, const char *p, size_t len) {
+    if (len == 0) return 0;
+    if (ss->n == SAVE_BATCH && saveFlush(ss) == -1) return -1;
+
+    ss->iov[ss->n].iov_base = (void *)p;
+    ss->iov[ss->n].iov_len = len;
+    ss->n++;
+    return 0;
+}
+
+int editorStreamRows(struct saveStream *ss) {
+    erow *row;
+    int j, len;
+
+    for (row = ropeFirst(E.rows); row; row = editorRowNext(row)) {
+        if (row->chars) {
+            if (saveAppend(ss, editorRowChars(row), row->size) == -1) return -1;
+            if (saveAppend(ss, "\n", 1) == -1) return -1;
+            continue;
+        }
+
+        if (E.src.cr == 0) {
+            // with no '\r' in the file a lazy span is already what we write
+            size_t start = editorSourceOffset(row->srcline);
+            size_t end = editorSourceOffset(row->srcline + row->lines);
+            if (saveAppend(ss, &E.src.map[start], end - start) == -1) return -1;
+            if (E.src.map[end - 1] != '\n' && saveAppend(ss, "\n", 1) == -1) return -1;
+            continue;
+        }
+
+        for (j = 0; j < row->lines; j++) {
+            char *s = editorSourceLine(row->srcline + j, &len);
+            if (saveAppend(ss, s, len) == -1) return -1;
+            if (saveAppend(ss, "\n", 1) == -1) return -1;
+        }
+    }
+
+    return saveFlush(ss);
+}
+
+void editorSyncDir(char *path) {
+    char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, slash - path + 1) : strdup(".");
+
+    int fd = open(dir, O_RDONLY);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+/*
+ * Writes the buffer to a temporary file next to the target, syncs it and
+ * renames it over the original. A failed or interrupted save leaves the
+ * original file exactly as it was.
+ */
+int editorWriteFile(char *filename, size_t *written) {
+    char *path = realpath(filename, NULL);
+    if (path == NULL) path = strdup(filename);
+
+    char *tmp = malloc(strlen(path) + 16);
+    sprintf(tmp, "%s.kayrakXXXXXX", path);
+
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
+        free(tmp);
+        free(path);
+        return -1;
+    }
+
+    struct stat st;
+    fchmod(fd, stat(path, &st) == 0 ? (st.st_mode & 07777) : 0644);
+
+    struct saveStream ss;
+    ss.fd = fd;
+    ss.n = 0;
+    ss.written = 0;
+
+    if (editorStreamRows(&ss) == -1 || fsync(fd) == -1 || rename(tmp, path) == -1) {
+        int saved_errno = errno;
+        close(fd);
+        unlink(tmp);
+        free(tmp);
+        free(path);
+        errno = saved_errno;
+        return -1;
+    }
+
+    editorSyncDir(path);
+    editorSourceRemap(fd);
+    E.src.path = strdup(filename);
+    close(fd);
+
+    *written = ss.written;
+    free(tmp);
+    free(path);
+    return 0;
+}
+
+/*
+ * Rows before E.dirtyrow still match the mapped file line for line, so only
+ * the bytes from that row's offset on can differ. They are rewritten in
+ * place, skipping rows and spans that already sit at the right offset, which
+ * turns same-length edits into small patches. Unlike editorWriteFile this is
+ * not atomic, so it is only tried on large files and only when it spares
+ * rewriting most of them. Returns 1 when a full save is needed instead.
+ */
+
+#define SAVE_INCREMENTAL_MIN (64 << 20)
+#define SAVE_BOUNCE (1 << 20)
+
+struct saveSegment {
+    const char *p;      // bytes to write, or NULL to move them within the file
+    size_t src;         // where the file bytes sit now
+    size_t dst;
+    size_t len;
+};
+
+/*
+ * Moves a piece of the file through a bounce buffer. Going forwards when it
+ * moves down and backwards when it moves up never overwrites bytes before
+ * they were read, the same way memmove works.
+ */
+int saveMove(int fd, struct saveSegment *seg, char *bounce, int backward) {
+    size_t done = 0;
+
+    while (done < seg->len) {
+        size_t c = seg->len - done;
+        if (c > SAVE_BOUNCE) c = SAVE_BOUNCE;
+        size_t o = backward ? seg->len - done - c : done;
+
+        memcpy(bounce, &E.src.map[seg->src + o], c);
+        size_t w = 0;
+        while (w < c) {
+            ssize_t n = pwrite(fd, bounce + w, c - w, seg->dst + o + w);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            w += n;
+        }
+        done += c;
+    }
+    return 0;
+}
+
+/*
+ * Like editorSourceRemap, but the file only changed from byte `from`, the
+ * start of line `at`, onwards, so only that part is indexed again.
+ */
+void editorSourceRescan(int fd, size_t size, int at, size_t from) {
+    struct editorSource *src = &E.src;
+
+    editorSyntaxCancel();
+    editorMapTrack(MAP_SOURCE, NULL, 0);
+    munmap(src->map, src->mapsize);
+    src->map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (src->map == MAP_FAILED) die("mmap");
+    src->size = size;
+    src->mapsize = size;
+    editorMapTrack(MAP_SOURCE, src->map, size);
+
+    src->numlines = at;
+    src->lf = at;
+    src->crlf = 0;
+    src->prevcr = 0;
+    if (editorSourceAddLine(src, from) == -1 || editorSourceScan(src, from, size) == -1)
+        die("mmap");
+
+    int off;
+    erow *row = ropeFind(at, &off);
+    for (at -= row ? off : 0; row; row = editorRowNext(row)) {
+        row->srcline = at;
+        at += row->lines;
+    }
+}
+
+int editorWriteChanges(size_t *written) {
+    struct editorSource *src = &E.src;
+
+    if (src->map == NULL || src->path == NULL || strcmp(src->path, E.filename)) return 1;
+    if (src->shrunk) return 1;
+    if (src->size < SAVE_INCREMENTAL_MIN || src->cr || src->map[src->size - 1] != '\n')
+        return 1;
+
+    int at = E.dirtyrow < E.numrows ? E.dirtyrow : E.numrows;
+    size_t from = editorSourceOffset(at);
+
+    // lay out the new tail and keep the pieces that are not in place yet
+    struct saveSegment *seg = NULL;
+    int n = 0, cap = 0, len, off;
+    size_t dst = from, total = 0;
+    int up = 0, down = 0;
+
+    erow *row = ropeFind(at, &off);
+    for (; row; row = editorRowNext(row), off = 0) {
+        if (n + 2 > cap) {
+            cap = cap ? cap * 2 : 64;
+            seg = realloc(seg, cap * sizeof(*seg));
+        }
+
+        if (row->chars) {
+            char *s = editorRowChars(row);
+            if (row->srcline >= 0 && editorSourceOffset(row->srcline) == dst) {
+                char *line = editorSourceLine(row->srcline, &len);
+                if (len == row->size && memcmp(line, s, len) == 0) {
+                    dst += len + 1;
+                    continue;
+                }
+            }
+            seg[n++] = (struct saveSegment){ s, 0, dst, row->size };
+            seg[n++] = (struct saveSegment){ "\n", 0, dst + row->size, 1 };
+            dst += row->size + 1;
+            total += row->size + 1;
+            continue;
+        }
+
+        size_t start = editorSourceOffset(row->srcline + off);
+        size_t end = editorSourceOffset(row->srcline + row->lines);
+        if (start != dst) {
+            seg[n++] = (struct saveSegment){ NULL, start, dst, end - start };
+            total += end - start;
+            if (dst > start) up = 1;
+            else down = 1;
+        }
+        dst += end - start;
+    }
+
+    // spans moving both ways could overwrite each other's bytes
+    if ((up && down) || dst == 0 || total > src->size / 2) {
+        free(seg);
+        return 1;
+    }
+
+    int fd = open(E.filename, O_RDWR);
+    if (fd == -1) {
+        free(seg);
+        return -1;
+    }
+
+    // reserve the blocks first so running out of space can't strike midway
+    if (dst > src->size && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, dst) == -1) {
+        close(fd);
+        free(seg);
+        return 1;
+    }
+
+    char *bounce = malloc(SAVE_BOUNCE);
+    struct saveStream ss;
+    ss.fd = fd;
+    ss.n = 0;
+    ss.written = 0;
+
+    int step = up ? -1 : 1;
+    int k, err = 0;
+    for (k = up ? n - 1 : 0; k >= 0 && k < n && !err; k += step) {
+        if (seg[k].p == NULL) {
+            err = saveMove(fd, &seg[k], bounce, up);
+            ss.written += seg[k].len;
+            continue;
+        }
+
+        // write a run of adjacent rows with one writev, in file order
+        int first = k, last = k;
+        if (up) {
+            while (first > 0 && seg[first - 1].p &&
+                   seg[first - 1].dst + seg[first - 1].len == seg[first].dst) first--;
+            k = first;
+        } else {
+            while (last < n - 1 && seg[last + 1].p &&
+                   seg[last].dst + seg[last].len == seg[last + 1].dst) last++;
+            k = last;
+        }
+
+        if (lseek(fd, seg[first].dst, SEEK_SET) == -1) {
+            err = -1;
+            break;
+        }
+        for (; first <= last && !err; first++)
+            err = saveAppend(&ss, seg[first].p, seg[first].len);
+        if (!err) err = saveFlush(&ss);
+    }
+    free(bounce);
+    free(seg);
+
+    if (err || (dst < src->size && ftruncate(fd, dst) == -1) || fsync(fd) == -1) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    editorSourceRescan(fd, dst, at, from);
+    close(fd);
+
+    *written = ss.written;
+    return 0;
+}
+
+void editorOpen(char *filename){
+    free(E.filename);
+    E.filename = strdup(filename);
+
+    editorSelectSyntaxHighlight();
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) die("open");
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        // a big file is indexed in the background, see LOADER
+        int async = st.st_size > LOAD_CHUNK;
+        if ((async ? editorSourceMap(fd, st.st_size) : editorSourceOpen(fd, st.st_size)) == 0) {
+            close(fd);
+            E.src.path = strdup(filename);
+
+            if (async) {
+                editorLoadStart();
+            } else if (E.src.numlines > 0) {
+                E.rows = editorNewSpan(0, E.src.numlines);
+                E.numrows = E.src.numlines;
+            }
+            E.dirty = 0;
+            E.dirtyrow = INT_MAX;
+            E.hlline = 0;
+            return;
+        }
+    }
+
+    FILE *fp = fdopen(fd, "r");
+    if(!fp) die("fdopen");
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    
+    while ((linelen = getline(&line, &linecap, fp)) != -1){
+        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+            linelen--;
+        editorInsertRow(E.numrows, line, linelen);
+    }
+    free(line);
+    fclose(fp);
+    E.dirty = 0;
+    E.dirtyrow = INT_MAX;
+}
+
+void editorSave() {
+    if (E.filename == NULL){
+            E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL, 0);
+            
+            if (E.filename == NULL) {
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+        
+        editorSelectSyntaxHighlight();
+    }
+    
+    size_t len;
+    int r = editorWriteChanges(&len);
+    if (r == 1) r = editorWriteFile(E.filename, &len);
+    if (r == 0) {
+        E.dirty = 0;
+        E.dirtyrow = INT_MAX;
+        editorJournalRemove();
+        editorSetStatusMessage("%zu bytes written to disk", len);
+        return;
+    }
+
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+}
+
+void editorSetConfig(){
+    FILE *fp = fopen("config.txt", "r");
+    if(!fp) die("fopen");
+
+    char *line = NULL;
+    size_t linecap = 0;
+    size_t linelen;
+    size_t linesep;
+    size_t linenum = 0;// matchcolor=123
+    
+    while ((linelen = getline(&line, &linecap, fp)) != -1){
+        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+            linelen--;
+
+        int i;
+        for (i = 0; i < linelen; i++){
+            if(line[i] == '='){ 
+                linesep = i;
+                break;  
+            }
+        }
+        
+        linenum++;
+        char *sep = strchr(line, '=');
+        if (sep == NULL) continue;
+
+        *sep = '\0';
+        //char *key = line;
+        char *strvalue = sep + 1;
+
+        int value = atoi(strvalue);
+
+        switch (linenum){
+            case 1:
+                HL_config.LineNumberMargin = value;
+                break;
+            case 2:
+                HL_config.TabStop = value;
+                break;
+            case 3:
+                HL_config.ConfirmQuitTimes = value;
+                break;
+            case 4:
+                HL_config.KeywordColor = value;
+                break;
+            case 5:
+                HL_config.VariableColor = value;
+                break;
+            case 6:
+                HL_config.CommentColor = value;
+                break;
+            case 7:
+                HL_config.MultilineCommentColor = value;
+                break;
+            case 8:
+                HL_config.StringColor = value;
+                break;
+            case 9:
+                HL_config.NumberColor = value;
+                break;
+            case 10:
+                HL_config.MatchColor = value;
+                break;
+            case 11:
+                HL_config.DefaultColor = value;
+                break;
+            case 12:
+                HL_config.FrameStats = value;
+                break;
+        }
+    }
+    
+    free(line);
+    fclose(fp);
+}
+
+/* VIEWER */
+
+/*
+ * `kayrak -R file` opens a file read-only without indexing it, for logs and
+ * traces too big for even a line index. Only a window of a few screens of
+ * rows around the cursor exists. The rows are taken out of a VIEW_MAP sized
+ * mapping that slides over the file, and editorViewSlide adds and drops rows
+ * at the edges as the cursor moves. Jumps and searches seek by byte offset.
+ * Line numbers are then estimated from the average line length and shown
+ * with a '~', until the window reaches the start of the file again. Memory
+ * stays about VIEW_MAP plus the window's rows, whatever the file's size.
+ */
+
+#define VIEW_MAP (16 << 20)
+#define VIEW_LINE_MAX (64 << 10)    // longer lines are shown cut in pieces
+#define VIEW_SAMPLE (256 << 10)     // bytes read at each of 4 places to guess linelen
+
+// returns the bytes [off, off + len) of the file, moving the mapping to them if needed
+char *editorViewBytes(size_t off, size_t len) {
+    struct editorView *v = &E.view;
+    if (off >= v->mapoff && off + len <= v->mapoff + v->maplen)
+        return &v->map[off - v->mapoff];
+
+    // centered on the request, so lines on either side of it are in as well
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = off + len / 2 > VIEW_MAP / 2 ? off + len / 2 - VIEW_MAP / 2 : 0;
+    start -= start % page;
+    size_t end = start + VIEW_MAP < v->size ? start + VIEW_MAP : v->size;
+
+    editorMapTrack(MAP_VIEW, NULL, 0);
+    if (v->map) munmap(v->map, v->maplen);
+    v->map = mmap(NULL, end - start, PROT_READ, MAP_SHARED, v->fd, start);
+    if (v->map == MAP_FAILED) die("mmap");
+    v->mapoff = start;
+    v->maplen = end - start;
+    editorMapTrack(MAP_VIEW, v->map, v->maplen);
+    return &v->map[off - start];
+}
+
+// inserts the line starting at `off` as row `at`; returns where the next line starts
+size_t editorViewRow(int at, size_t off) {
+    struct editorView *v = &E.view;
+    size_t len = v->size - off < VIEW_LINE_MAX ? v->size - off : VIEW_LINE_MAX;
+    char *s = editorViewBytes(off, len);
+    char *nl = memchr(s, '\n', len);
+    size_t next = nl ? off + (nl - s) + 1 : off + len;
+
+    if (nl) len = nl - s;
+    if (len > 0 && s[len - 1] == '\r') len--;
+    editorInsertRow(at, s, len);
+
+    if (E.numrows + 1 > v->offscap) {
+        v->offscap = v->offscap ? v->offscap * 2 : 256;
+        v->offs = realloc(v->offs, v->offscap * sizeof(size_t));
+        if (v->offs == NULL) die("realloc");
+    }
+    memmove(&v->offs[at + 1], &v->offs[at], (E.numrows - at) * sizeof(size_t));
+    v->offs[at] = off;
+    if (at == E.numrows - 1) v->offs[at + 1] = next;
+    return next;
+}
+
+// where the line holding byte `off` starts, looking back at most VIEW_LINE_MAX
+size_t editorViewLineStart(size_t off) {
+    size_t len = off < VIEW_LINE_MAX ? off : VIEW_LINE_MAX;
+    char *s = editorViewBytes(off - len, len);
+    char *nl = memrchr(s, '\n', len);
+    return nl ? off - len + (nl - s) + 1 : off - len;
+}
+
+// drops the first or the last row of the window
+void editorViewDrop(int at) {
+    struct editorView *v = &E.view;
+    editorDelRow(at);
+    // the last row's start becomes the window's end
+    if (at < E.numrows)
+        memmove(&v->offs[at], &v->offs[at + 1], (E.numrows + 1 - at) * sizeof(size_t));
+}
+
+/*
+ * Keeps two screens of rows on either side of the cursor, so that even a
+ * Page Up or Page Down stays inside the window, and drops rows past three.
+ */
+void editorViewSlide() {
+    struct editorView *v = &E.view;
+    if (!v->on) return;
+    int keep = E.screenrows * 2;
+
+    while (E.cy < keep && v->offs[0] > 0) {
+        // the line before row 0 ends with the '\n' just before it, if there is one
+        size_t end = v->offs[0];
+        if (*editorViewBytes(end - 1, 1) == '\n') end--;
+        editorViewRow(0, editorViewLineStart(end));
+        E.cy++;
+        E.rowoff++;
+        v->firstline--;
+    }
+    if (v->offs[0] == 0 && !v->exact) {
+        v->firstline = 0;
+        v->exact = 1;
+    }
+    while (E.numrows - E.cy < keep && v->offs[E.numrows] < v->size)
+        editorViewRow(E.numrows, v->offs[E.numrows]);
+
+    if (E.cy > keep * 3 / 2) {
+        while (E.cy > keep) {
+            editorViewDrop(0);
+            E.cy--;
+            E.rowoff--;
+            v->firstline++;
+        }
+        if (E.rowoff < 0) E.rowoff = 0;
+    }
+    if (E.numrows - E.cy > keep * 3 / 2)
+        while (E.numrows - E.cy > keep) editorViewDrop(E.numrows - 1);
+
+    // rows come and go here, but nothing was edited
+    E.dirty = 0;
+}
+
+// makes the line holding byte `off` the window's middle and puts the cursor on it
+void editorViewSeek(size_t off) {
+    struct editorView *v = &E.view;
+    if (off >= v->size) off = v->size ? v->size - 1 : 0;
+
+    size_t start = editorViewLineStart(off);
+    while (E.numrows) editorViewDrop(E.numrows - 1);
+    v->offs[0] = start;
+    v->firstline = start / v->linelen;
+    v->exact = start == 0;
+
+    E.cy = 0;
+    E.rowoff = 0;
+    editorViewSlide();
+    E.rowoff = E.cy;
+    E.cx = HL_config.LineNumberMargin;
+    erow *row = editorRowAt(E.cy);
+    if (row) E.cx += off - start < (size_t)row->size ? (int)(off - start) : row->size;
+}
+
+// the file offset of cx in row `at` of the window
+size_t editorViewOffset(int at, int cx) {
+    return E.view.offs[at < E.numrows ? at : E.numrows] + cx - HL_config.LineNumberMargin;
+}
+
+// lines in the whole file, counted once the window holds both ends, else estimated
+long editorViewLines(int *exact) {
+    struct editorView *v = &E.view;
+    *exact = v->exact && v->offs[E.numrows] == v->size;
+    return *exact ? v->firstline + E.numrows : (long)(v->size / v->linelen);
+}
+
+// Ctrl-G: a line number (estimated away from the window), @offset or N%
+void editorViewJump(char *query) {
+    struct editorView *v = &E.view;
+    size_t off;
+
+    if (query[0] == '@') {
+        off = strtoull(&query[1], NULL, 10);
+    } else if (strchr(query, '%')) {
+        off = v->size * (atof(query) / 100);
+    } else {
+        long line = atol(query) - 1;
+        if (line < 0) line = 0;
+        if (v->exact && line >= v->firstline && line < v->firstline + E.numrows) {
+            E.cy = line - v->firstline;
+            E.cx = HL_config.LineNumberMargin;
+            return;
+        }
+        off = line * v->linelen;
+    }
+    editorViewSeek(off);
+}
+
+/*
+ * Looks for the needle in the file past the window (direction 1) or before
+ * it (-1), a mapping at a time. The window is moved to the match, and its
+ * row and column are put in (*y, *x). Returns 0 if there is no match.
+ */
+int editorViewSearch(const struct searchNeedle *n, int direction, int *y, int *x) {
+    struct editorView *v = &E.view;
+    size_t step = VIEW_MAP / 2;
+    const char *m = NULL;
+    char *s;
+    size_t from = 0;
+    if (n->len == 0 || n->len > step) return 0;
+
+    if (direction > 0) {
+        for (from = v->offs[E.numrows]; m == NULL && from < v->size; from += step) {
+            // chunks overlap by len - 1, for matches across the boundary
+            size_t len = v->size - from < step + n->len - 1 ? v->size - from : step + n->len - 1;
+            s = editorViewBytes(from, len);
+            m = searchBytes(n, s, len);
+        }
+        from -= step;
+    } else {
+        size_t to = v->offs[0];
+        while (m == NULL && to > 0) {
+            from = to > step ? to - step : 0;
+            size_t end = to + n->len - 1 < v->offs[0] ? to + n->len - 1 : v->offs[0];
+            s = editorViewBytes(from, end - from);
+            m = searchBytesLast(n, s, end - from);
+            to = from;
+        }
+    }
+    if (m == NULL) return 0;
+
+    editorViewSeek(from + (m - s));
+    *y = E.cy;
+    *x = E.cx - HL_config.LineNumberMargin;
+    return 1;
+}
+
+void editorView(char *filename) {
+    struct editorView *v = &E.view;
+
+    // opened again, see FOLLOW
+    if (v->on) {
+        close(v->fd);
+        editorMapTrack(MAP_VIEW, NULL, 0);
+        if (v->map) munmap(v->map, v->maplen);
+        v->map = NULL;
+        v->mapoff = v->maplen = 0;
+    }
+
+    free(E.filename);
+    E.filename = strdup(filename);
+    editorSelectSyntaxHighlight();
+
+    v->fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (v->fd == -1) die("open");
+    struct stat st;
+    if (fstat(v->fd, &st) == -1 || !S_ISREG(st.st_mode)) die("fstat");
+    v->on = 1;
+    v->size = st.st_size;
+
+    // the average line length from a few samples across the file
+    size_t bytes = 0, lines = 0;
+    int i;
+    for (i = 0; i < 4; i++) {
+        size_t off = v->size / 4 * i;
+        size_t len = v->size - off < VIEW_SAMPLE ? v->size - off : VIEW_SAMPLE;
+        char *s = editorViewBytes(off, len), *p = s;
+        while ((p = memchr(p, '\n', len - (p - s)))) {
+            p++;
+            lines++;
+        }
+        bytes += len;
+    }
+    v->linelen = lines ? (double)bytes / lines : (bytes ? bytes : 1);
+
+    if (v->offs == NULL) {
+        v->offs = malloc(256 * sizeof(size_t));
+        v->offscap = 256;
+    }
+    editorViewSeek(0);
+}
+
+/* FOLLOW */
+
+/*
+ * `kayrak -F file` follows a growing file like `tail -f`. inotify wakes
+ * editorReadKey when the file or its directory changes. Bytes appended since
+ * the last look are read from the open descriptor and become new rows, and
+ * a last line without its line ending yet is grown in place. The view keeps
+ * up with the end while the cursor is on the last line. A file that shrank
+ * was truncated, and a different file under the same name means the old one
+ * was rotated away; either way it is loaded again from the start. With -R,
+ * the view's window takes in the new bytes instead of rows being added.
+ */
+
+#define FOLLOW_READ (64 << 10)
+
+int editorFollowFd() {
+    return E.follow.on ? E.follow.ifd : -1;
+}
+
+static void followWatch() {
+    struct editorFollow *f = &E.follow;
+    f->wd = inotify_add_watch(f->ifd, f->path, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+    if (f->wd == -1) die("inotify_add_watch");
+}
+
+// the last row, if the cursor is on it; appending then moves the cursor along
+static int followAtEnd() {
+    if (E.cy < E.numrows - 1) return 0;
+    return !E.view.on || E.view.offs[E.numrows] == E.view.size;
+}
+
+// takes in f->size onwards as rows, starting with the last one if it is unfinished
+static void followIngest(size_t size) {
+    struct editorFollow *f = &E.follow;
+    char buf[FOLLOW_READ];
+
+    while (f->size < size) {
+        ssize_t n = pread(f->fd, buf, sizeof(buf), f->size);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        f->size += n;
+
+        char *p = buf, *end = buf + n;
+        while (p < end) {
+            char *nl = memchr(p, '\n', end - p);
+            size_t len = (nl ? nl : end) - p;
+            if (f->partial && E.numrows)
+                editorRowAppendString(editorRowAt(E.numrows - 1), p, len);
+            else
+                editorInsertRow(E.numrows, p, len);
+
+            f->partial = nl == NULL;
+            if (nl) {
+                erow *row = editorRowAt(E.numrows - 1);
+                if (row->size && editorRowChar(row, row->size - 1) == '\r')
+                    editorRowDeleteString(row, row->size - 1, 1);
+            }
+            p = nl ? nl + 1 : end;
+        }
+    }
+    E.dirty = 0;
+}
+
+// opens the file again to read what is appended past the `size` bytes the buffer has
+static void followOpen(size_t size) {
+    struct editorFollow *f = &E.follow;
+
+    f->fd = open(f->path, O_RDONLY | O_CLOEXEC);
+    if (f->fd == -1) die("open");
+    f->size = size;
+    f->partial = 0;
+    if (f->size) {
+        char c;
+        if (pread(f->fd, &c, 1, f->size - 1) == 1) f->partial = c != '\n';
+    }
+    followWatch();
+}
+
+// starts over with the file now under the name
+static void followReload(const char *why) {
+    struct editorFollow *f = &E.follow;
+
+    inotify_rm_watch(f->ifd, f->wd);
+    close(f->fd);
+    if (E.view.on) {
+        editorView(f->path);
+    } else {
+        editorFreeRows();
+        editorSourceClose();
+        editorOpen(f->path);
+        editorLoadWait();
+    }
+    followOpen(E.view.on ? E.view.size : E.src.size);
+
+    E.cy = E.numrows ? E.numrows - 1 : 0;
+    E.cx = HL_config.LineNumberMargin;
+    if (E.view.on) editorViewSeek(E.view.size ? E.view.size - 1 : 0);
+    editorSetStatusMessage("%s was %s; loaded again", f->path, why);
+}
+
+/*
+ * Looks at the file after inotify said something changed. Returns 1 if the
+ * buffer changed with it.
+ */
+int editorFollowCheck() {
+    struct editorFollow *f = &E.follow;
+    if (!f->on || editorLoading()) return 0;
+
+    // Esc cut the load short, so the rows no longer end where the file did
+    if (!E.view.on && E.filename == NULL) {
+        f->on = 0;
+        return 0;
+    }
+
+    struct stat st, now;
+    if (fstat(f->fd, &st) == -1) die("fstat");
+    if (stat(f->path, &now) == 0 && (now.st_ino != st.st_ino || now.st_dev != st.st_dev)) {
+        followReload("rotated");
+        return 1;
+    }
+    if ((size_t)st.st_size < f->size) {
+        followReload("truncated");
+        return 1;
+    }
+    int atend = followAtEnd() || f->toend;
+    f->toend = 0;
+    if ((size_t)st.st_size == f->size) {
+        if (atend && !E.view.on) E.cy = E.numrows ? E.numrows - 1 : 0;
+        return atend;
+    }
+
+    if (E.view.on) {
+        struct editorView *v = &E.view;
+        size_t old = v->size;
+        v->size = st.st_size;
+        f->size = st.st_size;
+
+        // the last row was cut off at the old end of the file
+        if (E.numrows && v->offs[E.numrows] == old && *editorViewBytes(old - 1, 1) != '\n') {
+            editorViewDrop(E.numrows - 1);
+            if (E.cy > E.numrows) E.cy = E.numrows;
+        }
+        if (atend && v->size - old > VIEW_MAP) {
+            editorViewSeek(v->size - 1);
+            E.rowoff = E.cy > E.screenrows ? E.cy - E.screenrows + 1 : 0;
+        } else if (atend) {
+            do {
+                E.cy = E.numrows ? E.numrows - 1 : 0;
+                editorViewSlide();
+            } while (v->offs[E.numrows] < v->size);
+            E.cy = E.numrows ? E.numrows - 1 : 0;
+        } else {
+            editorViewSlide();
+        }
+        return 1;
+    }
+
+    followIngest(st.st_size);
+    if (atend) E.cy = E.numrows ? E.numrows - 1 : 0;
+    return 1;
+}
+
+// drains inotify and checks the file; returns 1 if the buffer changed
+int editorFollowEvent() {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (read(E.follow.ifd, buf, sizeof(buf)) > 0);
+    return editorFollowCheck();
+}
+
+void editorFollow(char *filename) {
+    struct editorFollow *f = &E.follow;
+
+    f->path = strdup(filename);
+    f->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (f->ifd == -1) die("inotify_init1");
+
+    // a rotated log comes back as a new file in the same directory
+    char *dir = strdup(filename);
+    char *slash = strrchr(dir, '/');
+    if (slash == dir) slash[1] = '\0';
+    else if (slash) *slash = '\0';
+    else strcpy(dir, ".");
+    f->dirwd = inotify_add_watch(f->ifd, dir, IN_CREATE | IN_MOVED_TO);
+    free(dir);
+    if (f->dirwd == -1) die("inotify_add_watch");
+
+    f->on = 1;
+    followOpen(E.view.on ? E.view.size : E.src.size);
+
+    // start at the end; a file still loading gets there in editorFollowCheck
+    if (E.view.on) {
+        editorViewSeek(E.view.size ? E.view.size - 1 : 0);
+        E.rowoff = E.cy > E.screenrows ? E.cy - E.screenrows + 1 : 0;
+    }
+    f->toend = !E.view.on;
+    editorFollowCheck();
+}
+
+/* REGEX */
+
+/*
+ * Find's regex mode. A pattern is parsed into a small syntax tree, which is
+ * built into two Thompson NFAs: one for the pattern and one for the pattern
+ * reversed. Each NFA runs as a DFA whose states are only built when the text
+ * first leads to them. A step is then one table lookup, so matching is
+ * linear in the text for any pattern, with no backtracking. A DFA that
+ * reaches RE_DFA_STATES states is emptied and starts over from where it is.
+ *
+ * Each line is matched on its own, between a BOL and an EOL symbol. ^ and
+ * $ take up no text: they wait in a DFA state until the BOL or EOL goes
+ * by, which passes them and leaves every other NFA state where it was.
+ * regexFindLine finds lines that hold a match in one pass of
+ * the forward DFA, with a loop in front so that a match can start anywhere.
+ * It runs over the mapped file, '\n's and all. On a line that matched, one
+ * backwards pass of the reversed DFA marks every position a match starts
+ * at. The forward DFA run from one of those gives the longest match there.
+ *
+ * Supported: literals and \-escapes, ., [classes] with ranges and ^, \d \w
+ * \s and their negations, ^ $, |, ( ) and (?: ), and * + ? {n} {n,} {n,m}.
+ */
+
+#define RE_BOL (256)            // symbols past the bytes
+#define RE_EOL (257)
+#define RE_SYMS (258)
+#define RE_SETWORDS ((RE_SYMS + 31) / 32)
+#define RE_MAX_STATES (20000)   // NFA states a pattern may build into
+#define RE_REPEAT_MAX (1000)
+#define RE_DFA_STATES (2048)
+#define RE_UNKNOWN INT_MIN      // a transition not built yet
+#define RE_EOLMATCH (INT_MIN + 1)   // a '\n' that ends a line holding a match
+
+enum reAstType { AST_SET, AST_EMPTY, AST_CAT, AST_ALT, AST_REPEAT, AST_ANCHOR };
+
+struct reAst {
+    enum reAstType type;
+    int a, b;               // children
+    int min, max;           // for AST_REPEAT, max -1 for no limit; min is the symbol for AST_ANCHOR
+    uint32_t set[RE_SETWORDS];
+};
+
+struct reParser {
+    const char *p;
+    const char *err;
+    struct reAst *ast;
+    int n, cap;
+};
+
+// NFA_ANCHOR is ^ or $, with RE_BOL or RE_EOL in out1. NFA_AT is in a DFA
+// state right after out1 went by, until the next byte
+enum reStateType { NFA_SET, NFA_SPLIT, NFA_MATCH, NFA_CR, NFA_ANCHOR, NFA_AT };
+
+struct reState {
+    enum reStateType type;
+    int out, out1;
+    uint32_t set[RE_SETWORDS];
+};
+
+struct reNFA {
+    struct reState *s;
+    int n, cap;
+    int start;              // anchored where the match starts
+    int loop;               // the same, after any text
+    int cr;                 // '\r's that may end a matched line, see reStep
+    int atbol, ateol;       // NFA_AT states
+};
+
+struct regex {
+    struct reNFA fwd, rev;
+    char *lit;              // bytes every match holds, in a row; see reLiteral
+    int litlen;
+};
+
+struct reDFA {
+    const struct reNFA *nfa;
+    int crlf;               // the forward DFA: '\n' ends a line, after any '\r's
+    int *trans;             // RE_SYMS per state: a state, ~state if it accepts, or RE_*
+    unsigned char *accept;
+    int *setoff, *setlen;   // each state's NFA states, in `sets`
+    int *sets;
+    size_t setsused, setscap;
+    int *hash;              // state ids, open addressing
+    int n, cap;
+    int line, loop, anchored, anchoredbol;  // start states, -1 until built
+
+    // scratch for reClosure
+    int *stack, *list;
+    unsigned int *mark, stamp;
+};
+
+struct reMatcher {
+    struct reDFA fwd, rev;
+    int *starts;
+    int startcap;
+};
+
+static void reSetAdd(uint32_t *set, int c) {
+    set[c / 32] |= 1u << (c % 32);
+}
+
+static int reSetHas(const uint32_t *set, int c) {
+    return (set[c / 32] >> (c % 32)) & 1;
+}
+
+static int reNode(struct reParser *ps, enum reAstType type, int a, int b) {
+    if (ps->n == ps->cap) {
+        ps->cap = ps->cap ? ps->cap * 2 : 32;
+        ps->ast = realloc(ps->ast, ps->cap * sizeof(struct reAst));
+        if (ps->ast == NULL) die("realloc");
+    }
+    struct reAst *t = &ps->ast[ps->n];
+    memset(t, 0, sizeof(*t));
+    t->type = type;
+    t->a = a;
+    t->b = b;
+    return ps->n++;
+}
+
+// the class a \-escape stands for, or just the byte
+static void reEscape(int c, uint32_t *set) {
+    int i;
+    uint32_t tmp[RE_SETWORDS] = {0};
+    int lc = tolower(c);
+
+    // only the classes have an upper case form, their negation
+    switch (c) {
+        case 'd': case 'D':
+            for (i = '0'; i <= '9'; i++) reSetAdd(tmp, i);
+            break;
+        case 'w': case 'W':
+            for (i = 0; i < 256; i++) if (isalnum(i) || i == '_') reSetAdd(tmp, i);
+            break;
+        case 's': case 'S':
+            for (i = 0; i < 256; i++) if (isspace(i)) reSetAdd(tmp, i);
+            break;
+        case 't': reSetAdd(set, '\t'); return;
+        case 'n': reSetAdd(set, '\n'); return;
+        case 'r': reSetAdd(set, '\r'); return;
+        case 'f': reSetAdd(set, '\f'); return;
+        case 'v': reSetAdd(set, '\v'); return;
+        default: reSetAdd(set, (unsigned char)c); return;
+    }
+    // \D \W \S
+    for (i = 0; i < 256; i++)
+        if (reSetHas(tmp, i) != (c != lc)) reSetAdd(set, i);
+}
+
+static int reClass(struct reParser *ps) {
+    int t = reNode(ps, AST_SET, -1, -1);
+    uint32_t set[RE_SETWORDS] = {0};
+    int negate = 0, i;
+
+    if (*ps->p == '^') {
+        negate = 1;
+        ps->p++;
+    }
+    int first = 1;
+    while (*ps->p && (*ps->p != ']' || first)) {
+        int lo = (unsigned char)*ps->p++;
+        first = 0;
+        if (lo == '\\') {
+            if (*ps->p == '\0') break;
+            int c = *ps->p++;
+            if (strchr("dDwWsS", c)) {
+                reEscape(c, set);
+                continue;
+            }
+            uint32_t one[RE_SETWORDS] = {0};
+            reEscape(c, one);
+            for (lo = 0; !reSetHas(one, lo); lo++);
+        }
+        int hi = lo;
+        if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+            hi = (unsigned char)ps->p[1];
+            ps->p += 2;
+            if (hi == '\\' && *ps->p) {
+                uint32_t one[RE_SETWORDS] = {0};
+                reEscape(*ps->p++, one);
+                for (hi = 0; hi < 256 && !reSetHas(one, hi); hi++);
+            }
+            if (hi < lo) {
+                ps->err = "bad range in [ ]";
+                return t;
+            }
+        }
+        for (i = lo; i <= hi; i++) reSetAdd(set, i);
+    }
+    if (*ps->p != ']') {
+        ps->err = "missing ]";
+        return t;
+    }
+    ps->p++;
+
+    for (i = 0; i < 256; i++)
+        if (reSetHas(set, i) != negate && i != '\n') reSetAdd(ps->ast[t].set, i);
+    return t;
+}
+
+static int reAlt(struct reParser *ps);
+
+static int reAtom(struct reParser *ps) {
+    int t, c = (unsigned char)*ps->p++;
+    switch (c) {
+        case '(':
+            if (ps->p[0] == '?' && ps->p[1] == ':') ps->p += 2;
+            t = reAlt(ps);
+            if (*ps->p != ')') {
+                if (!ps->err) ps->err = "missing )";
+                return t;
+            }
+            ps->p++;
+            return t;
+        case '[':
+            return reClass(ps);
+        case '.':
+            t = reNode(ps, AST_SET, -1, -1);
+            for (c = 0; c < 256; c++) if (c != '\n') reSetAdd(ps->ast[t].set, c);
+            return t;
+        case '^':
+            t = reNode(ps, AST_ANCHOR, -1, -1);
+            ps->ast[t].min = RE_BOL;
+            return t;
+        case '$':
+            t = reNode(ps, AST_ANCHOR, -1, -1);
+            ps->ast[t].min = RE_EOL;
+            return t;
+        case '\\':
+            if (*ps->p == '\0') {
+                ps->err = "trailing \\";
+                return reNode(ps, AST_EMPTY, -1, -1);
+            }
+            t = reNode(ps, AST_SET, -1, -1);
+            reEscape(*ps->p++, ps->ast[t].set);
+            return t;
+        case '*': case '+': case '?':
+            ps->err = "nothing to repeat";
+            return reNode(ps, AST_EMPTY, -1, -1);
+        default:
+            t = reNode(ps, AST_SET, -1, -1);
+            reSetAdd(ps->ast[t].set, c);
+            return t;
+    }
+}
+
+// reads {n}, {n,} or {n,m}; a '{' that does not start one is a literal
+static int reCount(struct reParser *ps, int *min, int *max) {
+    const char *p = ps->p + 1;
+    if (!isdigit((unsigned char)*p)) return 0;
+    *min = strtol(p, (char **)&p, 10);
+    *max = *min;
+    if (*p == ',') {
+        p++;
+        *max = isdigit((unsigned char)*p) ? (int)strtol(p, (char **)&p, 10) : -1;
+    }
+    if (*p != '}') return 0;
+    ps->p = p + 1;
+    return 1;
+}
+
+static int reRepeat(struct reParser *ps) {
+    int t = reAtom(ps);
+    while (!ps->err) {
+        int min, max;
+        char c = *ps->p;
+        if (c == '*') min = 0, max = -1;
+        else if (c == '+') min = 1, max = -1;
+        else if (c == '?') min = 0, max = 1;
+        else if (c == '{' && reCount(ps, &min, &max)) {
+            if (min > RE_REPEAT_MAX || max > RE_REPEAT_MAX || (max != -1 && max < min)) {
+                ps->err = "bad { } count";
+                return t;
+            }
+            t = reNode(ps, AST_REPEAT, t, -1);
+            ps->ast[t].min = min;
+            ps->ast[t].max = max;
+            continue;
+        } else break;
+        ps->p++;
+        t = reNode(ps, AST_REPEAT, t, -1);
+        ps->ast[t].min = min;
+        ps->ast[t].max = max;
+    }
+    return t;
+}
+
+static int reCat(struct reParser *ps) {
+    int t = -1;
+    while (*ps->p && *ps->p != '|' && *ps->p != ')' && !ps->err) {
+        int r = reRepeat(ps);
+        t = t == -1 ? r : reNode(ps, AST_CAT, t, r);
+    }
+    return t == -1 ? reNode(ps, AST_EMPTY, -1, -1) : t;
+}
+
+static int reAlt(struct reParser *ps) {
+    int t = reCat(ps);
+    while (*ps->p == '|' && !ps->err) {
+        ps->p++;
+        t = reNode(ps, AST_ALT, t, reCat(ps));
+    }
+    return t;
 }
 
-void editorRowDelChar(erow *row, int at) {
-    at -= HL_config.LineNumberMargin;
-    if (at < 0 || at >= row->size) return;
-    
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+static int reState(struct reNFA *nfa, enum reStateType type, int out, int out1) {
+    if (nfa->n == nfa->cap) {
+        nfa->cap = nfa->cap ? nfa->cap * 2 : 64;
+        nfa->s = realloc(nfa->s, nfa->cap * sizeof(struct reState));
+        if (nfa->s == NULL) die("realloc");
+    }
+    struct reState *s = &nfa->s[nfa->n];
+    memset(s, 0, sizeof(*s));
+    s->type = type;
+    s->out = out;
+    s->out1 = out1;
+    return nfa->n++;
+}
+
+// builds the states for t that lead on to `next`, back to front; returns the first
+static int reBuild(struct reNFA *nfa, const struct reAst *ast, int t, int next, int reverse) {
+    const struct reAst *a = &ast[t];
+    int s, i;
+
+    if (nfa->n > RE_MAX_STATES) return next;
+    switch (a->type) {
+        case AST_SET:
+            s = reState(nfa, NFA_SET, next, -1);
+            memcpy(nfa->s[s].set, a->set, sizeof(a->set));
+            return s;
+        case AST_EMPTY:
+            return next;
+        case AST_ANCHOR:
+            return reState(nfa, NFA_ANCHOR, next, a->min);
+        case AST_CAT:
+            if (reverse) return reBuild(nfa, ast, a->b, reBuild(nfa, ast, a->a, next, 1), 1);
+            return reBuild(nfa, ast, a->a, reBuild(nfa, ast, a->b, next, 0), 0);
+        case AST_ALT:
+            s = reBuild(nfa, ast, a->a, next, reverse);
+            return reState(nfa, NFA_SPLIT, s, reBuild(nfa, ast, a->b, next, reverse));
+        case AST_REPEAT:
+            if (a->max == -1) {
+                // a loop back to a split, then the copies that must be there
+                int split = reState(nfa, NFA_SPLIT, -1, next);
+                nfa->s[split].out = reBuild(nfa, ast, a->a, split, reverse);
+                s = a->min > 0 ? nfa->s[split].out : split;
+                for (i = 1; i < a->min; i++) s = reBuild(nfa, ast, a->a, s, reverse);
+                return s;
+            }
+            s = next;
+            for (i = a->min; i < a->max; i++)
+                s = reState(nfa, NFA_SPLIT, reBuild(nfa, ast, a->a, s, reverse), next);
+            for (i = 0; i < a->min; i++) s = reBuild(nfa, ast, a->a, s, reverse);
+            return s;
+    }
+    return next;
+}
+
+// the byte a set matches, if it is just one that can be in a line, else -1
+static int reSetByte(const uint32_t *set) {
+    int c, byte = -1;
+    for (c = 0; c < RE_SYMS; c++) {
+        if (!(set[c / 32] & (1u << (c % 32)))) continue;
+        if (byte != -1 || c >= 256 || c == '\n') return -1;
+        byte = c;
+    }
+    return byte;
+}
+
+/*
+ * The longest run of single bytes in the concatenation at the top of the
+ * pattern. Every match holds it, so lines without it need no DFA.
+ */
+static void reLiteral(struct regex *re, const struct reAst *ast, int t, char *run, int *runlen) {
+    const struct reAst *a = &ast[t];
+    int c;
+
+    if (a->type == AST_CAT) {
+        reLiteral(re, ast, a->a, run, runlen);
+        reLiteral(re, ast, a->b, run, runlen);
+    } else if (a->type == AST_SET && (c = reSetByte(a->set)) != -1) {
+        run[(*runlen)++] = c;
+        if (*runlen > re->litlen) {
+            memcpy(re->lit, run, *runlen);
+            re->litlen = *runlen;
+        }
+    } else if (a->type != AST_EMPTY && a->type != AST_ANCHOR) {
+        *runlen = 0;
+    }
+}
+
+static void reBuildNFA(struct reNFA *nfa, const struct reAst *ast, int root, int reverse) {
+    int match = reState(nfa, NFA_MATCH, -1, -1);
+    nfa->start = reBuild(nfa, ast, root, match, reverse);
+
+    // loop: any symbol, then back to the split in front of start
+    int any = reState(nfa, NFA_SET, -1, -1);
+    memset(nfa->s[any].set, 0xff, sizeof(nfa->s[any].set));
+    nfa->loop = reState(nfa, NFA_SPLIT, nfa->start, any);
+    nfa->s[any].out = nfa->loop;
+    nfa->cr = reState(nfa, NFA_CR, -1, -1);
+    nfa->atbol = reState(nfa, NFA_AT, -1, RE_BOL);
+    nfa->ateol = reState(nfa, NFA_AT, -1, RE_EOL);
+}
+
+void regexFree(struct regex *re) {
+    if (re == NULL) return;
+    free(re->fwd.s);
+    free(re->rev.s);
+    free(re->lit);
+    free(re);
+}
+
+// compiles pattern, or returns NULL and sets *err
+struct regex *regexCompile(const char *pattern, const char **err) {
+    struct reParser ps = {pattern, NULL, NULL, 0, 0};
+    int root = reAlt(&ps);
+    if (!ps.err && *ps.p == ')') ps.err = "unmatched )";
+    if (ps.err) {
+        free(ps.ast);
+        *err = ps.err;
+        return NULL;
+    }
+
+    struct regex *re = calloc(1, sizeof(struct regex));
+    if (re == NULL) die("calloc");
+    reBuildNFA(&re->fwd, ps.ast, root, 0);
+    reBuildNFA(&re->rev, ps.ast, root, 1);
+    int runlen = 0;
+    char *run = malloc(strlen(pattern) + 1);
+    re->lit = malloc(strlen(pattern) + 1);
+    if (run == NULL || re->lit == NULL) die("malloc");
+    reLiteral(re, ps.ast, root, run, &runlen);
+    free(run);
+    free(ps.ast);
+    if (re->fwd.n > RE_MAX_STATES || re->rev.n > RE_MAX_STATES) {
+        regexFree(re);
+        *err = "pattern too big";
+        return NULL;
+    }
+    return re;
+}
+
+/* the lazy DFA */
+
+static void reDFAInit(struct reDFA *d, const struct reNFA *nfa, int crlf) {
+    memset(d, 0, sizeof(*d));
+    d->nfa = nfa;
+    d->crlf = crlf;
+    d->hash = malloc(RE_DFA_STATES * 2 * sizeof(int));
+    d->stack = malloc((2 * nfa->n + 1) * sizeof(int));
+    d->list = malloc(nfa->n * sizeof(int));
+    d->mark = calloc(nfa->n, sizeof(unsigned int));
+    if (!d->hash || !d->stack || !d->list || !d->mark) die("malloc");
+    memset(d->hash, -1, RE_DFA_STATES * 2 * sizeof(int));
+    d->line = d->loop = d->anchored = d->anchoredbol = -1;
+}
+
+static void reDFAFree(struct reDFA *d) {
+    free(d->trans);
+    free(d->accept);
+    free(d->setoff);
+    free(d->setlen);
+    free(d->sets);
+    free(d->hash);
+    free(d->stack);
+    free(d->list);
+    free(d->mark);
+}
+
+// empties the DFA, once it has too many states
+static void reDFAFlush(struct reDFA *d) {
+    d->n = 0;
+    d->setsused = 0;
+    memset(d->hash, -1, RE_DFA_STATES * 2 * sizeof(int));
+    d->line = d->loop = d->anchored = d->anchoredbol = -1;
+}
+
+// adds the states reachable from s without consuming a symbol to d->list,
+// through the anchors whose symbols are in `at`, a mask of 1 << (sym - RE_BOL)
+static void reClosure(struct reDFA *d, int s, int *n, int at) {
+    const struct reState *st = d->nfa->s;
+    int top = 0;
+
+    d->stack[top++] = s;
+    while (top) {
+        s = d->stack[--top];
+        if (d->mark[s] == d->stamp) continue;
+        d->mark[s] = d->stamp;
+        if (st[s].type == NFA_SPLIT) {
+            d->stack[top++] = st[s].out1;
+            d->stack[top++] = st[s].out;
+        } else if (st[s].type == NFA_ANCHOR && (at >> (st[s].out1 - RE_BOL) & 1)) {
+            d->stack[top++] = st[s].out;
+        } else {
+            d->list[(*n)++] = s;
+        }
+    }
+}
+
+static void reNewStamp(struct reDFA *d) {
+    if (++d->stamp == 0) {
+        memset(d->mark, 0, d->nfa->n * sizeof(unsigned int));
+        d->stamp = 1;
+    }
+}
+
+static int reCmpInt(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// the DFA state for the n NFA states in d->list, built if it is new
+static int reIntern(struct reDFA *d, int n) {
+    const struct reState *st = d->nfa->s;
+    uint32_t h = 2166136261u;
+    int i;
+
+    qsort(d->list, n, sizeof(int), reCmpInt);
+    for (i = 0; i < n; i++) h = (h ^ (uint32_t)d->list[i]) * 16777619u;
+
+    unsigned int slot = h % (RE_DFA_STATES * 2);
+    while (d->hash[slot] != -1) {
+        int id = d->hash[slot];
+        if (d->setlen[id] == n && memcmp(&d->sets[d->setoff[id]], d->list, n * sizeof(int)) == 0)
+            return id;
+        slot = (slot + 1) % (RE_DFA_STATES * 2);
+    }
+
+    if (d->n == d->cap) {
+        d->cap = d->cap ? d->cap * 2 : 64;
+        d->trans = realloc(d->trans, (size_t)d->cap * RE_SYMS * sizeof(int));
+        d->accept = realloc(d->accept, d->cap);
+        d->setoff = realloc(d->setoff, d->cap * sizeof(int));
+        d->setlen = realloc(d->setlen, d->cap * sizeof(int));
+        if (!d->trans || !d->accept || !d->setoff || !d->setlen) die("realloc");
+    }
+    if (d->setsused + n > d->setscap) {
+        d->setscap = (d->setsused + n) * 2;
+        d->sets = realloc(d->sets, d->setscap * sizeof(int));
+        if (d->sets == NULL) die("realloc");
+    }
+
+    int id = d->n++;
+    for (i = 0; i < RE_SYMS; i++) d->trans[(size_t)id * RE_SYMS + i] = RE_UNKNOWN;
+    d->accept[id] = 0;
+    for (i = 0; i < n; i++) d->accept[id] |= st[d->list[i]].type == NFA_MATCH;
+    d->setoff[id] = d->setsused;
+    d->setlen[id] = n;
+    memcpy(&d->sets[d->setsused], d->list, n * sizeof(int));
+    d->setsused += n;
+    d->hash[slot] = id;
+    return id;
+}
+
+/*
+ * The NFA states of state `from` once BOL or EOL goes by, into d->list.
+ * Nothing moves but the anchors waiting on it. On an empty line BOL and EOL
+ * are in the same place, so the NFA_AT left by one lets the other pass too.
+ */
+static int reStepAnchor(struct reDFA *d, int from, int c) {
+    const struct reState *st = d->nfa->s;
+    const int *set = &d->sets[d->setoff[from]];
+    int len = d->setlen[from], n = 0, i;
+    int at = 1 << (c - RE_BOL);
+
+    for (i = 0; i < len; i++)
+        if (st[set[i]].type == NFA_AT) at |= 1 << (st[set[i]].out1 - RE_BOL);
+
+    reNewStamp(d);
+    for (i = 0; i < len; i++) {
+        const struct reState *s = &st[set[i]];
+        if (s->type == NFA_ANCHOR && (at >> (s->out1 - RE_BOL) & 1)) {
+            reClosure(d, s->out, &n, at);
+        } else if (s->type != NFA_AT && d->mark[set[i]] != d->stamp) {
+            d->mark[set[i]] = d->stamp;
+            d->list[n++] = set[i];
+        }
+    }
+    reClosure(d, c == RE_BOL ? d->nfa->atbol : d->nfa->ateol, &n, 0);
+    return n;
+}
+
+// whether a match could end at the end of the line, right after state `from`
+static int reEndsAtEol(struct reDFA *d, int from) {
+    const struct reState *st = d->nfa->s;
+    int n = reStepAnchor(d, from, RE_EOL), i;
+
+    for (i = 0; i < n; i++)
+        if (st[d->list[i]].type == NFA_MATCH) return 1;
+    return 0;
+}
+
+/*
+ * The NFA states of state `from` after symbol c, into d->list. In the
+ * forward DFA a '\r' also leads to the NFA_CR state if a match could end
+ * at the end of the line there, since '\r's before the '\n' are not part of
+ * the line.
+ */
+static int reStep(struct reDFA *d, int from, int c) {
+    if (c >= 256) return reStepAnchor(d, from, c);
+
+    const struct reState *st = d->nfa->s;
+    int cr = c == '\r' && d->crlf && reEndsAtEol(d, from);
+    const int *set = &d->sets[d->setoff[from]];
+    int len = d->setlen[from], n = 0, i;
+
+    reNewStamp(d);
+    for (i = 0; i < len; i++) {
+        const struct reState *s = &st[set[i]];
+        if (s->type == NFA_SET && reSetHas(s->set, c)) reClosure(d, s->out, &n, 0);
+        else if (s->type == NFA_CR && c == '\r') cr = 1;
+    }
+    if (cr) reClosure(d, d->nfa->cr, &n, 0);
+    return n;
+}
+
+// a start state: where a line starts, with or without the loop in front
+enum reStart { RE_LINE, RE_LOOP, RE_ANCHORED, RE_ANCHORED_BOL };
+
+static int reStart(struct reDFA *d, enum reStart kind) {
+    int *slot = kind == RE_LINE ? &d->line : kind == RE_LOOP ? &d->loop :
+        kind == RE_ANCHORED ? &d->anchored : &d->anchoredbol;
+    if (*slot >= 0) return *slot;
+    if (d->n + 2 > RE_DFA_STATES) reDFAFlush(d);
+
+    int n = 0;
+    reNewStamp(d);
+    reClosure(d, kind == RE_LINE || kind == RE_LOOP ? d->nfa->loop : d->nfa->start, &n, 0);
+    if (kind == RE_LINE || kind == RE_ANCHORED_BOL) {
+        // after the BOL that starts every line
+        int from = reIntern(d, n);
+        n = reStepAnchor(d, from, RE_BOL);
+    }
+    *slot = reIntern(d, n);
+    return *slot;
+}
+
+static int reEncode(struct reDFA *d, int id) {
+    return d->accept[id] ? ~id : id;
+}
+
+/*
+ * Builds the transition of state `from` on symbol c and returns it. After
+ * a flush `from` is gone, so the transition is returned but not kept.
+ */
+static int reTrans(struct reDFA *d, int from, int c) {
+    int t;
+
+    if (d->crlf && c == '\n') {
+        // the line ends: the next one starts over
+        int matched = reEndsAtEol(d, from), i;
+        const int *set = &d->sets[d->setoff[from]];
+        for (i = 0; i < d->setlen[from]; i++) matched |= d->nfa->s[set[i]].type == NFA_CR;
+
+        int flushed = d->n + 2 > RE_DFA_STATES;
+        int line = reStart(d, RE_LINE);
+        t = matched || d->accept[line] ? RE_EOLMATCH : line;
+        if (!flushed) d->trans[(size_t)from * RE_SYMS + c] = t;
+        return t;
+    }
+
+    int flushed = 0;
+    int n = reStep(d, from, c);
+    if (d->n + 1 > RE_DFA_STATES) {
+        // keep the NFA states across the flush
+        int *keep = malloc(n * sizeof(int));
+        if (keep == NULL) die("malloc");
+        memcpy(keep, d->list, n * sizeof(int));
+        reDFAFlush(d);
+        memcpy(d->list, keep, n * sizeof(int));
+        free(keep);
+        flushed = 1;
+    }
+    t = reEncode(d, reIntern(d, n));
+    if (!flushed) d->trans[(size_t)from * RE_SYMS + c] = t;
+    return t;
+}
+
+static int reNext(struct reDFA *d, int from, int c) {
+    int t = d->trans[(size_t)from * RE_SYMS + c];
+    return t == RE_UNKNOWN ? reTrans(d, from, c) : t;
+}
+
+struct reMatcher *regexMatcher(const struct regex *re) {
+    struct reMatcher *m = calloc(1, sizeof(struct reMatcher));
+    if (m == NULL) die("calloc");
+    reDFAInit(&m->fwd, &re->fwd, 1);
+    reDFAInit(&m->rev, &re->rev, 0);
+    return m;
+}
+
+void regexMatcherFree(struct reMatcher *m) {
+    if (m == NULL) return;
+    reDFAFree(&m->fwd);
+    reDFAFree(&m->rev);
+    free(m->starts);
+    free(m);
+}
+
+/*
+ * Finds a line in [s, end) that holds a match, where lines end in '\n' and
+ * so does the run, unless it ends the file. Returns a byte of that line,
+ * its '\n' if the match is at its end, or NULL.
+ */
+const char *regexFindLine(struct reMatcher *m, const char *s, const char *end) {
+    struct reDFA *d = &m->fwd;
+    const unsigned char *p = (const unsigned char *)s, *e = (const unsigned char *)end;
+    int st = reStart(d, RE_LINE);
+
+    if (p < e && d->accept[st]) return s;
+    while (p < e) {
+        int t = d->trans[(size_t)st * RE_SYMS + *p];
+        if (t == RE_UNKNOWN) t = reTrans(d, st, *p);
+        if (t < 0) return (const char *)p;
+        st = t;
+        p++;
+    }
+    // the file's last line, with no '\n'
+    if (e > (const unsigned char *)s && e[-1] != '\n' && reNext(d, st, '\n') < 0) return end - 1;
+    return NULL;
+}
+
+// whether the line s[0, len), without its line ending, holds a match
+int regexLineMatches(struct reMatcher *m, const char *s, int len) {
+    struct reDFA *d = &m->fwd;
+    int st = reStart(d, RE_LINE), i;
+
+    if (d->accept[st]) return 1;
+    for (i = 0; i < len; i++) {
+        int t = reNext(d, st, (unsigned char)s[i]);
+        if (t < 0) return 1;
+        st = t;
+    }
+    return reNext(d, st, '\n') < 0;
+}
+
+/*
+ * Every position in the line s[0, len) where a match starts, in order, in
+ * m->starts. Returns how many there are.
+ */
+int regexStarts(struct reMatcher *m, const char *s, int len) {
+    struct reDFA *d = &m->rev;
+    int n = 0, i, t;
+
+    if (m->startcap < len + 1) {
+        m->startcap = len + 1;
+        m->starts = realloc(m->starts, m->startcap * sizeof(int));
+        if (m->starts == NULL) die("realloc");
+    }
+
+    // backwards: EOL, the bytes, BOL
+    t = reNext(d, reStart(d, RE_LOOP), RE_EOL);
+    if (t < 0) m->starts[n++] = len;
+    for (i = len - 1; i >= 0; i--) {
+        t = reNext(d, t < 0 ? ~t : t, (unsigned char)s[i]);
+        if (t < 0) m->starts[n++] = i;
+    }
+    t = reNext(d, t < 0 ? ~t : t, RE_BOL);
+    if (t < 0 && (n == 0 || m->starts[n - 1] != 0)) m->starts[n++] = 0;
+
+    for (i = 0; i < n / 2; i++) {
+        int tmp = m->starts[i];
+        m->starts[i] = m->starts[n - 1 - i];
+        m->starts[n - 1 - i] = tmp;
+    }
+    return n;
+}
+
+// the end of the longest match starting at s[at] in the line s[0, len), or -1
+int regexEnd(struct reMatcher *m, const char *s, int len, int at) {
+    struct reDFA *d = &m->fwd;
+    int st = reStart(d, at == 0 ? RE_ANCHORED_BOL : RE_ANCHORED);
+    int best = d->accept[st] ? at : -1, i;
+
+    for (i = at; i < len && d->setlen[st]; i++) {
+        int t = reNext(d, st, (unsigned char)s[i]);
+        st = t < 0 ? ~t : t;
+        if (t < 0) best = i + 1;
+    }
+    if (i == len && d->setlen[st]) {
+        int t = reNext(d, st, RE_EOL);
+        if (t < 0) best = len;
+    }
+    return best;
+}
+
+/* SEARCH */
+
+/*
+ * Searching runs over the raw bytes, not the tab-expanded render. A lazy
+ * span is searched as one run of the mapped file, without loading its rows,
+ * and a hit is mapped back to its line through the line index. Only the row
+ * that matched is loaded, to place the cursor and mark the match.
+ *
+ * A one byte needle goes to memchr. Longer ones go through a SIMD filter
+ * that compares the needle's first and last bytes against 32 (or 16)
+ * positions at once, and memcmp checks the few candidates that pass. That
+ * runs at about memory speed for any length, faster than Horspool's skips
+ * measured on both code and prose. Text that keeps passing the filter, like
+ * "aaaa...b" in a run of a's, would make it quadratic in the needle's
+ * length, and so would glibc's memmem. Needles of SEARCH_LONG bytes or more
+ * therefore hand over to Two-Way once false candidates pass SEARCH_MISSES.
+ * Two-Way is linear in the worst case, and with a bad byte shift on the
+ * needle's last byte it also skips like Horspool.
+ */
+
+#define SEARCH_LONG (32)
+#define SEARCH_MISSES(scanned) ((scanned) / 8 + 256)
+#define SEARCH_BACK_CHUNK (1 << 20)  // how far back a backward search looks at a time
+
+// the critical factorization of the needle for Two-Way: where it splits and its period
+static void searchFactor(const unsigned char *s, size_t len, int greater, size_t *split, size_t *period) {
+    size_t i = -1, j = 0, k = 1, p = 1;
+
+    // the maximal suffix by the byte order, or by its reverse
+    while (j + k < len) {
+        unsigned char a = s[i + k], b = s[j + k];
+        if (a == b) {
+            if (k == p) {
+                j += p;
+                k = 1;
+            } else {
+                k++;
+            }
+        } else if (greater ? a > b : a < b) {
+            j += k;
+            k = 1;
+            p = j - i;
+        } else {
+            i = j++;
+            k = p = 1;
+        }
+    }
+    *split = i;
+    *period = p;
+}
+
+void searchCompile(struct searchNeedle *n, const char *s, size_t len) {
+    n->s = s;
+    n->len = len;
+    n->re = NULL;
+    if (len < SEARCH_LONG) return;
+
+    const unsigned char *u = (const unsigned char *)s;
+    size_t i, ms, p, ms2, p2;
+    for (i = 0; i < 256; i++) n->shift[i] = len;
+    for (i = 0; i < len; i++) n->shift[u[i]] = len - 1 - i;
+
+    searchFactor(u, len, 1, &ms, &p);
+    searchFactor(u, len, 0, &ms2, &p2);
+    if (ms2 + 1 > ms + 1) {
+        ms = ms2;
+        p = p2;
+    }
+
+    // a needle with period p can keep what matched when it moves by p
+    n->split = ms;
+    if (memcmp(u, u + p, ms + 1) != 0) {
+        n->period = (ms > len - ms - 1 ? ms : len - ms - 1) + 1;
+        n->keep = 0;
+    } else {
+        n->period = p;
+        n->keep = len - p;
+    }
+}
+
+static const char *searchTwoWay(const struct searchNeedle *n, const char *hay, size_t len) {
+    const unsigned char *h = (const unsigned char *)hay, *end = h + len;
+    const unsigned char *u = (const unsigned char *)n->s;
+    size_t l = n->len, ms = n->split, mem = 0, k;
+
+    while ((size_t)(end - h) >= l) {
+        // the last byte first, shifting like Horspool on a mismatch
+        k = n->shift[h[l - 1]];
+        if (k) {
+            h += k > mem ? k : mem;
+            mem = 0;
+            continue;
+        }
+
+        // the right part, then the left one
+        for (k = ms + 1 > mem ? ms + 1 : mem; k < l && u[k] == h[k]; k++);
+        if (k < l) {
+            h += k - ms;
+            mem = 0;
+            continue;
+        }
+        for (k = ms + 1; k > mem && u[k - 1] == h[k - 1]; k--);
+        if (k <= mem) return (const char *)h;
+        h += n->period;
+        mem = n->keep;
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__)
+
+static const char *searchSSE2(const struct searchNeedle *n, const char *hay, size_t len) {
+    size_t k = n->len;
+    const __m128i first = _mm_set1_epi8(n->s[0]);
+    const __m128i last = _mm_set1_epi8(n->s[k - 1]);
+    size_t i, misses = 0;
+
+    for (i = 0; i + k - 1 + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)&hay[i]);
+        __m128i b = _mm_loadu_si128((const __m128i *)&hay[i + k - 1]);
+        uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+
+        while (mask) {
+            size_t at = i + __builtin_ctz(mask);
+            if (memcmp(&hay[at + 1], &n->s[1], k - 2) == 0) return &hay[at];
+            if (++misses > SEARCH_MISSES(i) && k >= SEARCH_LONG) return searchTwoWay(n, &hay[i], len - i);
+            mask &= mask - 1;
+        }
+    }
+    return memmem(&hay[i], len - i, n->s, k);
+}
+
+__attribute__((target("avx2")))
+static const char *searchAVX2(const struct searchNeedle *n, const char *hay, size_t len) {
+    size_t k = n->len;
+    const __m256i first = _mm256_set1_epi8(n->s[0]);
+    const __m256i last = _mm256_set1_epi8(n->s[k - 1]);
+    size_t i, misses = 0;
+
+    for (i = 0; i + k - 1 + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)&hay[i]);
+        __m256i b = _mm256_loadu_si256((const __m256i *)&hay[i + k - 1]);
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+
+        while (mask) {
+            size_t at = i + __builtin_ctz(mask);
+            if (memcmp(&hay[at + 1], &n->s[1], k - 2) == 0) return &hay[at];
+            if (++misses > SEARCH_MISSES(i) && k >= SEARCH_LONG) return searchTwoWay(n, &hay[i], len - i);
+            mask &= mask - 1;
+        }
+    }
+    return memmem(&hay[i], len - i, n->s, k);
+}
+
+#endif
+
+// the first match in hay[0, len), or NULL
+const char *searchBytes(const struct searchNeedle *n, const char *hay, size_t len) {
+    if (n->len == 0 || n->len > len) return NULL;
+    if (n->len == 1) return memchr(hay, n->s[0], len);
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) return searchAVX2(n, hay, len);
+    return searchSSE2(n, hay, len);
+#else
+    if (n->len >= SEARCH_LONG) return searchTwoWay(n, hay, len);
+    return memmem(hay, len, n->s, n->len);
+#endif
+}
+
+// the last match in hay[0, len), looking back a chunk at a time
+const char *searchBytesLast(const struct searchNeedle *n, const char *hay, size_t len) {
+    size_t to = len;
+    if (n->len == 0) return NULL;
+    if (n->len == 1) return memrchr(hay, n->s[0], len);
+
+    while (to > 0) {
+        // matches starting in [from, to), which may run on past `to`
+        size_t from = to > SEARCH_BACK_CHUNK ? to - SEARCH_BACK_CHUNK : 0;
+        size_t end = to + n->len - 1 < len ? to + n->len - 1 : len;
+        const char *m, *last = NULL;
+        for (m = &hay[from]; (m = searchBytes(n, m, &hay[end] - m)); m++) last = m;
+        if (last) return last;
+        to = from;
+    }
+    return NULL;
+}
+
+/*
+ * Finds the first match at or after (*y, *x) with direction 1, or the last
+ * one before it with -1, where x indexes the row's chars. The search wraps
+ * around the buffer once if `wrap` is set. Returns 1 and sets (*y, *x) if
+ * there is a match.
+ */
+// the text of row y, without moving its gap if it is a lazy span's line
+static const char *searchLineText(int y, int *len) {
+    int off;
+    erow *row = ropeFind(y, &off);
+    if (row->chars) {
+        *len = row->size;
+        return editorRowChars(row);
+    }
+    return editorSourceLine(row->srcline + off, len);
+}
+
+// editorSearch for a regex, a line at a time
+static int editorSearchRegex(struct reMatcher *m, int *y, int *x, int direction, int wrap) {
+    int row = *y < E.numrows ? *y : E.numrows - 1;
+    int col = *y < E.numrows ? *x : INT_MAX;    // where to start in the first row
+    int i, j;
+
+    for (i = 0; i <= E.numrows; i++) {
+        int len, n;
+        const char *s = searchLineText(row, &len);
+        if (regexLineMatches(m, s, len) && (n = regexStarts(m, s, len)) > 0) {
+            if (direction > 0) {
+                for (j = 0; j < n && m->starts[j] < col; j++);
+            } else {
+                for (j = n - 1; j >= 0 && m->starts[j] >= col; j--);
+            }
+            if (j >= 0 && j < n) {
+                *y = row;
+                *x = m->starts[j];
+                return 1;
+            }
+        }
+
+        col = direction > 0 ? 0 : INT_MAX;
+        row += direction;
+        if (row < 0 || row >= E.numrows) {
+            if (!wrap) return 0;
+            row = direction > 0 ? 0 : E.numrows - 1;
+        }
+    }
+    return 0;
+}
+
+int editorSearch(const struct searchNeedle *n, int *y, int *x, int direction, int wrap) {
+    if (E.numrows == 0 || n->len == 0) return 0;
+    if (n->re) return editorSearchRegex(n->re, y, x, direction, wrap);
+
+    int row = *y < E.numrows ? *y : E.numrows - 1;
+    int col = *y < E.numrows ? *x : INT_MAX;    // where to start in the first row, -1 past it
+    int off;
+    erow *node = ropeFind(row, &off), *startnode = node;
+    int at = row - off;                         // the row the node starts at
+    int wrapped = 0;
+
+    while (1) {
+        const char *hay, *hit = NULL;
+        size_t from, to;
+
+        if (node->chars) {
+            hay = editorRowChars(node);
+            from = 0;
+            to = node->size;
+        } else {
+            // the span's lines as one run of the mapped file
+            hay = E.src.map;
+            from = editorSourceOffset(node->srcline);
+            to = editorSourceOffset(node->srcline + node->lines);
+        }
+        if (col >= 0) {
+            size_t here = (node->chars ? 0 : editorSourceOffset(node->srcline + off)) + (size_t)col;
+            if (here > to) here = to;
+            // backwards, a match must start before `here` but may end past it
+            if (direction > 0) from = here;
+            else to = here + n->len - 1 < to ? here + n->len - 1 : to;
+        }
+        if (to > from) {
+            hit = direction > 0 ? searchBytes(n, &hay[from], to - from) :
+                searchBytesLast(n, &hay[from], to - from);
+        }
+        if (hit) {
+            size_t pos = hit - hay;
+            if (node->chars) {
+                *y = at;
+                *x = pos;
+            } else {
+                int line = editorSourceLineAt(pos);
+                *y = at + line - node->srcline;
+                *x = pos - editorSourceOffset(line);
+            }
+            return 1;
+        }
+        if (wrapped && node == startnode) return 0;
+
+        col = -1;
+        if (direction > 0) {
+            at += node->lines;
+            node = editorRowNext(node);
+        } else {
+            node = editorRowPrev(node);
+            if (node) at -= node->lines;
+        }
+        if (node == NULL) {
+            if (!wrap) return 0;
+            wrapped = 1;
+            node = direction > 0 ? ropeFirst(E.rows) : ropeLast(E.rows);
+            at = direction > 0 ? 0 : E.numrows - node->lines;
+        }
+    }
+}
+
+/*
+ * Stepping from one match to the next cannot tell how many there are, so
+ * Find also indexes every match in the buffer. The rows are cut into ranges
+ * of SEARCH_RANGE_ROWS, and a pool of threads, the main one included, takes
+ * ranges in order until a SEARCH_SLICE_MS time slice is over. Each range's
+ * matches come out in order, so joining the ranges in order gives one sorted
+ * array, and stepping through matches is a binary search in it.
+ *
+ * editorReadKey runs a slice whenever no input is waiting, so typing is
+ * never held up by more than a slice, and a key that changes the query
+ * drops the scan that was under way. The ranges taken so far are always
+ * done, so the first match is known as soon as a range with one is, before
+ * the rest of the buffer has been scanned.
+ *
+ * A query that contains the previous one can only match on rows where that
+ * one did. If those were few, only they are scanned again.
+ *
+ * In regex mode the same scan runs regexFindLine over the rows, and every
+ * position where a match starts is indexed, see REGEX.
+ *
+ * The threads only read the rows, which the main thread does not change
+ * while it waits for them. A row whose gap is not at its end is copied
+ * rather than having the gap moved. The index is kept until the query or
+ * the rows change, see E.edits. Past SEARCH_INDEX_MAX matches only the count
+ * is kept, and stepping scans with editorSearch.
+ */
+
+#define SEARCH_RANGE_ROWS (16384)
+#define SEARCH_SLICE_MS (10)
+#define SEARCH_REFINE (8)               // rescan the rows that matched if under 1/8 of all
+#define SEARCH_THREADS_MAX (16)
+#define SEARCH_LITERAL_MIN (2)          // shorter literals in a regex are too common to skip lines by
+#define SEARCH_INDEX_MAX (16 << 20)     // matches to keep; past it they are only counted
+#define SEARCH_SHOWN_SLOTS (256)        // rows whose matches on screen are kept, see searchShownRow
+#define SEARCH_SHOWN_PROBE (4)
+
+struct searchMatch {
+    int y, x;               // row, and index in its chars
+};
+
+struct searchRange {
+    int from, to;           // rows, or indexes in SEARCH.cand
+    struct searchMatch *m;
+    size_t len, cap;
+    size_t count;
+};
+
+struct searchShown {
+    erow *row;
+    unsigned int gen;       // the row's gen
+    unsigned int query;     // SEARCH.querygen
+    unsigned int used;      // the frame it was last drawn in
+    int *spans;             // render columns of the matches, from and to in pairs
+    int n, cap;
+};
+
+struct editorMatches {
+    int nthreads;           // the main thread included, 0 until the pool starts
+    pthread_t threads[SEARCH_THREADS_MAX];
+    pthread_mutex_t lock;
+    pthread_cond_t start, done;
+    unsigned int round;     // bumped to send the pool through a slice
+    void (*task)(int id);   // what each thread runs in it
+    int busy;               // pool threads still in this slice
+    struct timespec deadline;
+
+    // the scan
+    int next;               // the next range to take
+    int taken;              // ranges done, all before `next`
+    int nranges;
+    struct searchRange *ranges;
+    int *cand;              // the rows to scan, or NULL for all of them
+    size_t stored;          // matches kept by all the ranges
+
+    int valid;
+    int finished;
+    char *query;
+    struct searchNeedle needle;
+    int regex;              // Find takes the query as a regex, toggled with Ctrl-E
+    int replacing;          // Find's prompt asks what to replace, see REPLACE
+    int isregex;            // the index is for one
+    struct regex *re;
+    struct reMatcher *matchers[SEARCH_THREADS_MAX];     // a DFA cache for each thread
+    struct searchNeedle lit;    // the regex's literal, if it has a long enough one
+    const char *err;        // why the regex did not compile
+    unsigned int edits;     // E.edits when it started
+    struct searchMatch *m;  // sorted, or NULL if there were over SEARCH_INDEX_MAX
+    size_t count;
+    size_t cur;             // the match the cursor is on, counting from 1, or 0
+    int y, x;               // where that is, -1 if the cursor is on none
+    int jump;               // move to the first match once it is known
+
+    // what the screen shows
+    int marky, markx, marklen;  // the match the cursor is on, marky -1 for none
+    unsigned int querygen;  // bumped with every scan
+    unsigned int frame;
+    struct searchShown shown[SEARCH_SHOWN_SLOTS];
+};
+
+struct editorMatches SEARCH = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+    .y = -1,
+    .marky = -1,
+};
+
+static void searchRangeAdd(struct searchRange *r, int y, int x) {
+    r->count++;
+    if (__atomic_add_fetch(&SEARCH.stored, 1, __ATOMIC_RELAXED) > SEARCH_INDEX_MAX) return;
+    if (r->len == r->cap) {
+        r->cap = r->cap ? r->cap * 2 : 256;
+        r->m = realloc(r->m, r->cap * sizeof(struct searchMatch));
+        if (r->m == NULL) die("realloc");
+    }
+    r->m[r->len].y = y;
+    r->m[r->len].x = x;
+    r->len++;
+}
+
+// the DFA cache of thread `id`, made on first use
+static struct reMatcher *searchMatcher(int id) {
+    if (SEARCH.matchers[id] == NULL) SEARCH.matchers[id] = regexMatcher(SEARCH.re);
+    return SEARCH.matchers[id];
+}
+
+// the regex matches on the lines of node, as for searchNode
+static void searchNodeRegex(struct searchRange *r, erow *node, int at, int first, int last,
+    const char *text, int id) {
+    struct reMatcher *m = searchMatcher(id);
+    const struct searchNeedle *lit = &SEARCH.lit;
+    int i, n;
+
+    if (node->chars) {
+        if (lit->len && !searchBytes(lit, text, node->size)) return;
+        if (!regexLineMatches(m, text, node->size)) return;
+        n = regexStarts(m, text, node->size);
+        for (i = 0; i < n; i++) searchRangeAdd(r, at, m->starts[i]);
+        return;
+    }
+
+    const char *hay = E.src.map, *p;
+    int line = node->srcline + first;
+    size_t next = editorSourceOffset(line + 1);
+    size_t to = editorSourceOffset(node->srcline + last);
+
+    // a hit is a line that holds a match, or the literal, which it then must
+    // be checked for. The next line is usually close, so it is stepped to first.
+    for (p = &hay[editorSourceOffset(line)];
+        (p = lit->len ? searchBytes(lit, p, &hay[to] - p) : regexFindLine(m, p, &hay[to]));
+        p = &hay[next]) {
+        size_t pos = p - hay;
+        if (pos >= next) {
+            line++;
+            next = editorSourceOffset(line + 1);
+            if (pos >= next) {
+                line = editorSourceLineAt(pos);
+                next = editorSourceOffset(line + 1);
+            }
+        }
+        int len;
+        const char *s = editorSourceLine(line, &len);
+        if (!lit->len || regexLineMatches(m, s, len)) {
+            n = regexStarts(m, s, len);
+            for (i = 0; i < n; i++) searchRangeAdd(r, at + line - node->srcline, m->starts[i]);
+        }
+        if (next >= to) break;
+    }
+}
+
+// the matches on lines [first, last) of node, which starts at row `at`
+static void searchNode(struct searchRange *r, erow *node, int at, int first, int last, char **copy, int id) {
+    const struct searchNeedle *n = &SEARCH.needle;
+    const char *hay, *p;
+
+    if (node->chars) {
+        hay = node->chars;
+        if (node->gap < node->size) {
+            *copy = realloc(*copy, node->size);
+            if (*copy == NULL) die("realloc");
+            memcpy(*copy, node->chars, node->gap);
+            memcpy(&(*copy)[node->gap], &node->chars[node->gap + node->gaplen], node->size - node->gap);
+            hay = *copy;
+        }
+        if (SEARCH.isregex) {
+            searchNodeRegex(r, node, at, first, last, hay, id);
+            return;
+        }
+        for (p = hay; (p = searchBytes(n, p, &hay[node->size] - p)); p++)
+            searchRangeAdd(r, at, p - hay);
+        return;
+    }
+    if (SEARCH.isregex) {
+        searchNodeRegex(r, node, at, first, last, NULL, id);
+        return;
+    }
+
+    // the lines as one run of the mapped file
+    int line = node->srcline + first;
+    size_t next = editorSourceOffset(line + 1);
+    hay = E.src.map;
+    size_t to = editorSourceOffset(node->srcline + last);
+
+    for (p = &hay[editorSourceOffset(line)]; (p = searchBytes(n, p, &hay[to] - p)); p++) {
+        size_t pos = p - hay;
+        // matches are often on the next line; only farther ones need a lookup
+        if (pos >= next) {
+            next = editorSourceOffset(++line + 1);
+            if (pos >= next) {
+                line = editorSourceLineAt(pos);
+                next = editorSourceOffset(line + 1);
+            }
+        }
+        searchRangeAdd(r, at + line - node->srcline, pos - editorSourceOffset(line));
+    }
+}
+
+static void searchRange(struct searchRange *r, int id) {
+    char *copy = NULL;
+    int i, off;
+
+    if (SEARCH.cand) {
+        for (i = r->from; i < r->to; i++) {
+            erow *node = ropeFind(SEARCH.cand[i], &off);
+            searchNode(r, node, SEARCH.cand[i] - off, off, off + 1, &copy, id);
+        }
+        free(copy);
+        return;
+    }
+
+    erow *node = ropeFind(r->from, &off);
+    int at = r->from - off;     // the row the node starts at
+    for (; node && at < r->to; at += node->lines, node = editorRowNext(node)) {
+        int first = at < r->from ? r->from - at : 0;
+        int last = at + node->lines > r->to ? r->to - at : node->lines;
+        searchNode(r, node, at, first, last, &copy, id);
+    }
+    free(copy);
+}
+
+// takes ranges until the slice is over, at least one so that the scan gets on
+static void searchTakeRanges(int id) {
+    struct timespec now;
+    int i;
+    while ((i = __atomic_fetch_add(&SEARCH.next, 1, __ATOMIC_RELAXED)) < SEARCH.nranges) {
+        searchRange(&SEARCH.ranges[i], id);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > SEARCH.deadline.tv_sec ||
+            (now.tv_sec == SEARCH.deadline.tv_sec && now.tv_nsec >= SEARCH.deadline.tv_nsec)) return;
+    }
+}
+
+void *editorSearchMain(void *arg) {
+    struct editorMatches *s = &SEARCH;
+    int id = (intptr_t)arg;     // the pool's threads count from 1
+    unsigned int seen = 0;
+
+    pthread_mutex_lock(&s->lock);
+    while (1) {
+        while (s->round == seen) pthread_cond_wait(&s->start, &s->lock);
+        seen = s->round;
+        void (*task)(int) = s->task;
+        pthread_mutex_unlock(&s->lock);
+
+        task(id);
+
+        pthread_mutex_lock(&s->lock);
+        if (--s->busy == 0) pthread_cond_signal(&s->done);
+    }
+    return NULL;
+}
+
+static void searchFreeRanges() {
+    struct editorMatches *s = &SEARCH;
+    int i;
+    for (i = 0; i < s->nranges; i++) free(s->ranges[i].m);
+    free(s->ranges);
+    free(s->cand);
+    s->ranges = NULL;
+    s->cand = NULL;
+    s->nranges = 0;
+}
+
+void editorSearchIndexFree() {
+    struct editorMatches *s = &SEARCH;
+    int i;
+    searchFreeRanges();
+    for (i = 0; i < SEARCH_THREADS_MAX; i++) {
+        regexMatcherFree(s->matchers[i]);
+        s->matchers[i] = NULL;
+    }
+    regexFree(s->re);
+    s->lit.len = 0;
+    free(s->query);
+    free(s->m);
+    s->re = NULL;
+    s->err = NULL;
+    s->isregex = 0;
+    s->query = NULL;
+    s->m = NULL;
+    s->count = s->cur = 0;
+    s->y = -1;
+    s->valid = s->finished = s->jump = 0;
+}
+
+// there is a scan to go on with, see editorSearchSlice
+int editorSearchPending() {
+    return SEARCH.valid && !SEARCH.finished;
+}
+
+/*
+ * Starts indexing the matches of query, unless that is already under way
+ * or done. The scan itself runs in editorSearchSlice. query must not be
+ * SEARCH.query, see searchRestart.
+ */
+void editorSearchIndex(const char *query) {
+    struct editorMatches *s = &SEARCH;
+    if (s->valid && s->edits == E.edits && s->isregex == s->regex && strcmp(s->query, query) == 0) return;
+
+    // the rows the previous query matched on, if this one contains it
+    int *cand = NULL;
+    int ncand = 0;
+    if (s->finished && s->m && s->edits == E.edits && s->count <= (size_t)E.numrows / SEARCH_REFINE &&
+        !s->regex && !s->isregex && strstr(query, s->query)) {
+        size_t i;
+        cand = malloc((s->count ? s->count : 1) * sizeof(int));
+        if (cand == NULL) die("malloc");
+        for (i = 0; i < s->count; i++)
+            if (ncand == 0 || cand[ncand - 1] != s->m[i].y) cand[ncand++] = s->m[i].y;
+    }
+
+    int y = s->y, x = s->x, jump = s->jump;
+    editorSearchIndexFree();
+    s->y = y;
+    s->x = x;
+    s->jump = jump;
+    s->valid = 1;
+    s->querygen++;
+    s->query = strdup(query);
+    s->edits = E.edits;
+    searchCompile(&s->needle, s->query, strlen(s->query));
+    if (s->regex && s->needle.len) {
+        s->isregex = 1;
+        s->re = regexCompile(s->query, &s->err);
+        if (s->re == NULL) s->needle.len = 0;
+        else if (s->re->litlen >= SEARCH_LITERAL_MIN) searchCompile(&s->lit, s->re->lit, s->re->litlen);
+    }
+    s->cand = cand;
+    s->next = s->taken = 0;
+    s->stored = 0;
+
+    int units = cand ? ncand : E.numrows;
+    int i;
+    s->nranges = s->needle.len ? (units + SEARCH_RANGE_ROWS - 1) / SEARCH_RANGE_ROWS : 0;
+    s->ranges = calloc(s->nranges ? s->nranges : 1, sizeof(struct searchRange));
+    if (s->ranges == NULL) die("calloc");
+    for (i = 0; i < s->nranges; i++) {
+        s->ranges[i].from = i * SEARCH_RANGE_ROWS;
+        s->ranges[i].to = i == s->nranges - 1 ? units : (i + 1) * SEARCH_RANGE_ROWS;
+    }
+    if (s->nranges == 0) {
+        searchFreeRanges();
+        s->finished = 1;
+    }
 }
 
-/* EDITOR OPERATIONS */
+// scans again for the same query, after the rows changed
+static void searchRestart() {
+    char *query = strdup(SEARCH.query);
+    editorSearchIndex(query);
+    free(query);
+}
 
-void editorInsertChar(int c) {
-    if (E.cy == E.numrows) {
-        editorInsertRow(E.numrows, "", 0);
+// joins the ranges in order into the one sorted array
+static void searchFinish() {
+    struct editorMatches *s = &SEARCH;
+    size_t len = 0;
+    int i;
+
+    if (s->count <= SEARCH_INDEX_MAX) {
+        s->m = malloc((s->count ? s->count : 1) * sizeof(struct searchMatch));
+        if (s->m == NULL) die("malloc");
+        for (i = 0; i < s->nranges; i++) {
+            if (s->ranges[i].len == 0) continue;
+            memcpy(&s->m[len], s->ranges[i].m, s->ranges[i].len * sizeof(struct searchMatch));
+            len += s->ranges[i].len;
+        }
     }
-    
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+    searchFreeRanges();
+    s->finished = 1;
 }
 
-void editorInsertNewline() {
-    if (E.cx == HL_config.LineNumberMargin) {
-        editorInsertRow(E.cy, "", 0);
+// the first match, if the ranges taken so far tell where it is
+static int searchFirst(int *y, int *x) {
+    struct editorMatches *s = &SEARCH;
+    int i;
+
+    if (s->finished) {
+        if (s->count == 0) return 0;
+        if (s->m) {
+            *y = s->m[0].y;
+            *x = s->m[0].x;
+            return 1;
+        }
     } else {
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx - HL_config.LineNumberMargin], row->size - E.cx + HL_config.LineNumberMargin);
-        row = &E.row[E.cy];
-        row->size = E.cx - HL_config.LineNumberMargin;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+        for (i = 0; i < s->taken && s->ranges[i].count == 0; i++);
+        if (i == s->taken) return 0;
+        if (s->ranges[i].len) {
+            *y = s->ranges[i].m[0].y;
+            *x = s->ranges[i].m[0].x;
+            return 1;
+        }
     }
-    E.cy++;
-    E.cx = HL_config.LineNumberMargin;
+    // its position was not kept
+    *y = *x = 0;
+    if (s->isregex) s->needle.re = searchMatcher(0);
+    return editorSearch(&s->needle, y, x, 1, 0);
 }
 
-void editorInsertTab(){
-    int space_num;
-    if ((E.cx - HL_config.LineNumberMargin) % HL_config.TabStop == 0){
-        space_num = HL_config.TabStop ;
-    }else{
-        space_num = HL_config.TabStop  - ((E.cx - HL_config.LineNumberMargin) % HL_config.TabStop );
+// the first match in the index at or after (y, x)
+static size_t searchLowerBound(int y, int x) {
+    size_t lo = 0, hi = SEARCH.count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const struct searchMatch *m = &SEARCH.m[mid];
+        if (m->y < y || (m->y == y && m->x < x)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Every match on screen is shown, not just the one the cursor is on. A row's
+ * matches are found when it is first drawn and kept in SEARCH.shown, keyed by
+ * the row, its gen and the query, so scrolling back over rows does not search
+ * them again. editorDrawRows paints them over the row's hl, which stays as
+ * the highlighter left it.
+ */
+
+// the match the cursor is on, drawn apart from the rest; y < 0 for none
+static void editorFindMark(int y, int x, int len) {
+    SEARCH.marky = y;
+    SEARCH.markx = x;
+    SEARCH.marklen = len;
+}
+
+// adds the match chars[from, to) of row
+static void searchShownAdd(struct searchShown *e, erow *row, int from, int to) {
+    if (e->n + 2 > e->cap) {
+        e->cap = e->cap ? e->cap * 2 : 16;
+        e->spans = realloc(e->spans, e->cap * sizeof(int));
+        if (e->spans == NULL) die("realloc");
+    }
+    e->spans[e->n++] = editorRowCxToRx(row, from);
+    e->spans[e->n++] = editorRowCxToRx(row, to);
+}
+
+// the matches on row that do not overlap, leftmost first; empty ones are left out
+static void searchShownFind(struct searchShown *e, erow *row) {
+    const char *s = editorRowChars(row);
+    int len = row->size, at = 0, i, n;
+
+    e->n = 0;
+    if (SEARCH.isregex) {
+        struct reMatcher *m = searchMatcher(0);
+        if (!regexLineMatches(m, s, len)) return;
+        n = regexStarts(m, s, len);
+        for (i = 0; i < n; i++) {
+            if (m->starts[i] < at) continue;
+            int end = regexEnd(m, s, len, m->starts[i]);
+            if (end <= m->starts[i]) continue;
+            searchShownAdd(e, row, m->starts[i], end);
+            at = end;
+        }
+        return;
     }
 
+    const char *p;
+    for (p = s; (p = searchBytes(&SEARCH.needle, p, &s[len] - p)); p += SEARCH.needle.len)
+        searchShownAdd(e, row, p - s, p - s + SEARCH.needle.len);
+}
+
+/*
+ * The matches on a row about to be drawn, or NULL when Find is not open.
+ * A row goes in one of SEARCH_SHOWN_PROBE slots from where its address
+ * hashes to, in place of its own stale entry or else the one drawn longest
+ * ago.
+ */
+const struct searchShown *searchShownRow(erow *row) {
+    if (!SEARCH.valid || SEARCH.needle.len == 0 || E.view.on) return NULL;
+
+    size_t h = ((uintptr_t)row >> 4) * 2654435761u;
+    struct searchShown *e, *victim = NULL;
     int i;
-    for (i = 0; i < space_num; i++){
-        editorInsertChar(' ');
+    for (i = 0; i < SEARCH_SHOWN_PROBE; i++) {
+        e = &SEARCH.shown[(h + i) % SEARCH_SHOWN_SLOTS];
+        if (e->row == row) {
+            if (e->gen == row->gen && e->query == SEARCH.querygen) {
+                e->used = SEARCH.frame;
+                return e;
+            }
+            victim = e;
+            break;
+        }
+        if (victim == NULL || e->used < victim->used) victim = e;
     }
-    
+
+    victim->row = row;
+    victim->gen = row->gen;
+    victim->query = SEARCH.querygen;
+    victim->used = SEARCH.frame;
+    searchShownFind(victim, row);
+    return victim;
 }
 
-void editorDelChar() {
-    if (E.cy == E.numrows) return;
-    if (E.cx == HL_config.LineNumberMargin && E.cy == 0) return;
-    
-    erow *row = &E.row[E.cy];
-    if (E.cx > HL_config.LineNumberMargin) {
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
-    }else if(E.cx == HL_config.LineNumberMargin){
-        E.cx = E.row[E.cy - 1].size + HL_config.LineNumberMargin;
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        editorDelRow(E.cy);
-        E.cy--;
-  }
+// how long the match at (y, x) is; a regex's is its longest match there
+static int searchMatchLen(int y, int x) {
+    if (!SEARCH.isregex) return SEARCH.needle.len;
+    int len;
+    const char *s = searchLineText(y, &len);
+    int end = regexEnd(searchMatcher(0), s, len, x);
+    return end > x ? end - x : 0;
 }
 
-/*  FILE I/O */
+// puts the cursor on the match at (y, x)
+static void editorFindGo(int y, int x, int len) {
+    SEARCH.y = y;
+    SEARCH.x = x;
+    E.cy = y;
+    E.cx = x + HL_config.LineNumberMargin;
+    E.rowoff = E.numrows;
+    editorFindMark(y, x, len);
+}
 
-char *editorRowsToString(int *buflen) {
-    int totlen = 0;
-    int j;
-    for (j = 0; j < E.numrows; j++)
-        totlen += E.row[j].size + 1;
+// runs task on every thread of the pool, this one as id 0, and waits for them
+void searchPoolRun(void (*task)(int id)) {
+    struct editorMatches *s = &SEARCH;
+
+    if (s->nthreads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        s->nthreads = cpus < 1 ? 1 : cpus > SEARCH_THREADS_MAX ? SEARCH_THREADS_MAX : cpus;
+        int i;
+        for (i = 1; i < s->nthreads; i++) {
+            if (pthread_create(&s->threads[i], NULL, editorSearchMain, (void *)(intptr_t)i) != 0)
+                die("pthread_create");
+            pthread_detach(s->threads[i]);
+        }
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->round++;
+    s->task = task;
+    s->busy = s->nthreads - 1;
+    pthread_cond_broadcast(&s->start);
+    pthread_mutex_unlock(&s->lock);
+
+    task(0);
+
+    pthread_mutex_lock(&s->lock);
+    while (s->busy) pthread_cond_wait(&s->done, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Runs the scan for one time slice, and moves to the first match if that
+ * became known. Returns 1 if there is something new to show.
+ */
+int editorSearchSlice() {
+    struct editorMatches *s = &SEARCH;
+    if (!editorSearchPending()) return 0;
+
+    // rows that changed under the scan make it start over
+    if (s->edits != E.edits) searchRestart();
+
+    clock_gettime(CLOCK_MONOTONIC, &s->deadline);
+    s->deadline.tv_nsec += SEARCH_SLICE_MS * 1000000L;
+    if (s->deadline.tv_nsec >= 1000000000L) {
+        s->deadline.tv_sec++;
+        s->deadline.tv_nsec -= 1000000000L;
+    }
+    searchPoolRun(searchTakeRanges);
+
+    int taken = s->next < s->nranges ? s->next : s->nranges;
+    for (; s->taken < taken; s->taken++) s->count += s->ranges[s->taken].count;
+    if (s->taken == s->nranges) searchFinish();
+
+    int y, x;
+    if (s->jump && searchFirst(&y, &x)) {
+        s->jump = 0;
+        s->cur = 1;
+        editorFindGo(y, x, searchMatchLen(y, x));
+    } else if (s->finished && s->m && s->y >= 0) {
+        s->cur = searchLowerBound(s->y, s->x) + 1;
+    }
+    if (s->finished) s->jump = 0;
+    return 1;
+}
+
+/*
+ * Like editorSearch, but from the index: the first match at or after
+ * (*y, *x), or the last one before it, wrapping around. Until the index is
+ * done this falls back to editorSearch.
+ */
+int editorSearchIndexStep(int *y, int *x, int direction) {
+    struct editorMatches *s = &SEARCH;
+    if (s->edits != E.edits) searchRestart();
+    if (s->finished && s->count == 0) return 0;
+    if (!s->finished || s->m == NULL) {
+        s->cur = 0;
+        if (s->isregex) s->needle.re = searchMatcher(0);
+        return editorSearch(&s->needle, y, x, direction, 1);
+    }
+
+    size_t i = searchLowerBound(*y, *x);
+    if (direction > 0) {
+        if (i == s->count) i = 0;
+    } else {
+        if (i == 0) i = s->count;
+        i--;
+    }
+    *y = s->m[i].y;
+    *x = s->m[i].x;
+    s->cur = i + 1;
+    return 1;
+}
+
+// Find's prompt, which says whether the query is a regex
+static char *editorFindPrompt() {
+    static char prompt[64];
+    const char *what = SEARCH.replacing ? (SEARCH.regex ? "Regex replace" : "Replace") :
+        (SEARCH.regex ? "Regex search" : "Search");
+    snprintf(prompt, sizeof(prompt), "%s: %%s (Use ESC/Arrows/Enter, Ctrl-E = %s)",
+    what, SEARCH.regex ? "text" : "regex");
+    return prompt;
+}
+
+void editorFindCallback(char *query, int key) {
+    static int direction = 1;
+    struct editorMatches *s = &SEARCH;
+
+    editorFindMark(-1, 0, 0);
+
+    if (key == '\r' || key == '\x1b') {
+        direction = 1;
+        editorSearchIndexFree();
+        return;
+    } else if (key == CTRL_KEY('e') && !E.view.on) {
+        // the same query again, the other way
+        s->regex = !s->regex;
+        editorFindPrompt();
+        s->y = -1;
+        direction = 1;
+    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+        direction = 1;
+    } else if (key == ARROW_LEFT || key == ARROW_UP) {
+        direction = -1;
+    } else {
+        s->y = -1;
+        direction = 1;
+    }
+
+    if (E.view.on) {
+        // a view's window does not wrap; the rest of the file is searched after it
+        struct searchNeedle n;
+        searchCompile(&n, query, strlen(query));
+        int y = 0, x = 0;
+        if (s->y == -1) direction = 1;
+        else {
+            y = s->y;
+            x = s->x + (direction > 0);
+        }
+        int found = editorSearch(&n, &y, &x, direction, 0);
+        if (!found) found = editorViewSearch(&n, direction, &y, &x);
+        if (found) editorFindGo(y, x, n.len);
+        return;
+    }
+
+    // a new query goes to its first match as soon as the scan finds it
+    if (s->y == -1) {
+        editorSearchIndex(query);
+        s->jump = 1;
+        editorSearchSlice();
+        return;
+    }
+
+    // stepping starts just past the last match
+    int y = s->y, x = s->x + (direction > 0);
+    if (editorSearchIndexStep(&y, &x, direction)) editorFindGo(y, x, searchMatchLen(y, x));
+}
+
+void editorFind() {  
+    int saved_cx = E.cx;
+    int saved_cy = E.cy;
+    int saved_coloff = E.coloff;
+    int saved_rowoff = E.rowoff;
+    // a search can move a view's window, so there the cursor is kept as an offset
+    size_t saved_off = E.view.on ? editorViewOffset(E.cy, E.cx) : 0;
     
-    *buflen = totlen;
-    char *buf = malloc(totlen);
-    char *p = buf;
+    char *query = editorPrompt(E.view.on ? "Search: %s (Use ESC/Arrows/Enter)" : editorFindPrompt(),
+    editorFindCallback, 0);
     
-    for (j = 0; j < E.numrows; j++) {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+    if (query) {
+        free(query);
+    } else if (E.view.on) {
+        editorViewSeek(saved_off);
+    } else {
+        E.cx = saved_cx;
+        E.cy = saved_cy;
+        E.coloff = saved_coloff;
+        E.rowoff = saved_rowoff;
     }
-    
-    return buf;
 }
 
-void editorOpen(char *filename){
-    free(E.filename);
-    E.filename = strdup(filename);
+/* REPLACE */
 
-    editorSelectSyntaxHighlight();
+/*
+ * Replace all works from Find's index of the matches, so a regex works the
+ * same way. The pool builds the new text of every row that changes, reading
+ * the old text in place, with one allocation per row. The main thread then
+ * swaps each one in with editorRowReplace and logs it as one delete and one
+ * insert, all in a single undo group. A match that overlaps an earlier one
+ * on its row is left alone.
+ */
 
-    FILE *fp = fopen(filename, "r");
-    if(!fp) die("fopen");
+#define REPLACE_CHUNK (256)     // rows a thread takes at a time
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    
-    while ((linelen = getline(&line, &linecap, fp)) != -1){
-        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-            linelen--;
-        editorInsertRow(E.numrows, line, linelen);
+struct replaceRow {
+    int y;
+    size_t first, last;     // its matches, in SEARCH.m
+    char *text;             // the new text, from the pool
+    int len;
+    int from, oldto, newto; // text[from, oldto) became text[from, newto)
+    int count;              // matches replaced
+};
+
+struct editorReplace {
+    struct replaceRow *rows;
+    int nrows;
+    int next;               // the next chunk of rows to take
+    const char *with;
+    int withlen;
+};
+
+struct editorReplace REPLACE;
+
+// the text of row y for a pool thread, which must leave the row as it is
+static const char *replaceRowText(int y, int *len, char **copy) {
+    int off;
+    erow *row = ropeFind(y, &off);
+    if (row->chars == NULL) return editorSourceLine(row->srcline + off, len);
+
+    *len = row->size;
+    if (row->gap == row->size) return row->chars;
+    *copy = realloc(*copy, row->size);
+    if (*copy == NULL) die("realloc");
+    memcpy(*copy, row->chars, row->gap);
+    memcpy(&(*copy)[row->gap], &row->chars[row->gap + row->gaplen], row->size - row->gap);
+    return *copy;
+}
+
+static void replaceBuild(struct replaceRow *r, int id, char **copy, int **keep, int *keepcap) {
+    struct reMatcher *m = SEARCH.isregex ? searchMatcher(id) : NULL;
+    int len, n = 0, end = -1, i;
+    const char *s = replaceRowText(r->y, &len, copy);
+    size_t j;
+
+    if (*keepcap < (int)(r->last - r->first) * 2) {
+        *keepcap = (r->last - r->first) * 2;
+        *keep = realloc(*keep, *keepcap * sizeof(int));
+        if (*keep == NULL) die("realloc");
     }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+
+    // the matches to replace, as start and length, and how long the row gets
+    int newlen = len;
+    for (j = r->first; j < r->last; j++) {
+        int x = SEARCH.m[j].x;
+        int mlen = m ? regexEnd(m, s, len, x) - x : (int)SEARCH.needle.len;
+        if (mlen < 0 || x < end || (mlen == 0 && x == end)) continue;
+        (*keep)[n * 2] = x;
+        (*keep)[n * 2 + 1] = mlen;
+        n++;
+        end = x + mlen;
+        newlen += REPLACE.withlen - mlen;
+    }
+
+    char *t = malloc(newlen + 1);
+    if (t == NULL) die("malloc");
+    int at = 0, p = 0;
+    for (i = 0; i < n; i++) {
+        int x = (*keep)[i * 2];
+        memcpy(&t[p], &s[at], x - at);
+        p += x - at;
+        memcpy(&t[p], REPLACE.with, REPLACE.withlen);
+        p += REPLACE.withlen;
+        at = x + (*keep)[i * 2 + 1];
+    }
+    memcpy(&t[p], &s[at], len - at);
+
+    r->text = t;
+    r->len = newlen;
+    r->count = n;
+    r->from = n ? (*keep)[0] : 0;
+    r->oldto = n ? end : 0;
+    r->newto = r->oldto + newlen - len;
 }
 
-void editorSave() {
-    if (E.filename == NULL){
-            E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-            
-            if (E.filename == NULL) {
-            editorSetStatusMessage("Save aborted");
+static void replaceTakeRows(int id) {
+    char *copy = NULL;
+    int *keep = NULL, keepcap = 0;
+    int i;
+    while ((i = __atomic_fetch_add(&REPLACE.next, REPLACE_CHUNK, __ATOMIC_RELAXED)) < REPLACE.nrows) {
+        int end = i + REPLACE_CHUNK < REPLACE.nrows ? i + REPLACE_CHUNK : REPLACE.nrows;
+        for (; i < end; i++) replaceBuild(&REPLACE.rows[i], id, &copy, &keep, &keepcap);
+    }
+    free(copy);
+    free(keep);
+}
+
+// replaces every match of query, a regex in Find's regex mode, with `with`
+void editorReplaceAll(const char *query, const char *with) {
+    struct editorMatches *s = &SEARCH;
+    struct editorReplace *r = &REPLACE;
+    struct timespec start, now;
+    size_t i, count = 0;
+    int n;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    editorSearchIndex(query);
+    s->jump = 0;
+    while (editorSearchPending()) editorSearchSlice();
+
+    if (s->err) {
+        editorSetStatusMessage("Bad regex: %s", s->err);
+        editorSearchIndexFree();
+        return;
+    }
+    if (s->count == 0 || s->m == NULL) {
+        if (s->count) editorSetStatusMessage("Too many matches (%zu) to replace at once", s->count);
+        else editorSetStatusMessage("No matches");
+        editorSearchIndexFree();
+        return;
+    }
+
+    // a replaceRow for each row with matches
+    r->nrows = 0;
+    for (i = 0; i < s->count; i++)
+        if (i == 0 || s->m[i].y != s->m[i - 1].y) r->nrows++;
+    r->rows = calloc(r->nrows, sizeof(struct replaceRow));
+    if (r->rows == NULL) die("calloc");
+    for (i = 0, n = -1; i < s->count; i++) {
+        if (i == 0 || s->m[i].y != s->m[i - 1].y) {
+            r->rows[++n].y = s->m[i].y;
+            r->rows[n].first = i;
+        }
+        r->rows[n].last = i + 1;
+    }
+    r->next = 0;
+    r->with = with;
+    r->withlen = strlen(with);
+    searchPoolRun(replaceTakeRows);
+
+    editorUndoBegin();
+    for (n = 0; n < r->nrows; n++) {
+        struct replaceRow *row = &r->rows[n];
+        int len;
+        const char *old = searchLineText(row->y, &len);
+        if (row->oldto > row->from)
+            editorUndoRecord(UNDO_DELETE, row->y, row->from, &old[row->from], row->oldto - row->from, 0);
+        if (row->newto > row->from)
+            editorUndoRecord(UNDO_INSERT, row->y, row->from, &row->text[row->from], row->newto - row->from, 0);
+        editorRowReplace(row->y, row->text, row->len);
+        count += row->count;
+    }
+    editorUndoEnd();
+
+    free(r->rows);
+    r->rows = NULL;
+    editorSearchIndexFree();
+
+    if (E.cy < E.numrows) {
+        int size = editorRowAt(E.cy)->size;
+        if (E.cx > size + HL_config.LineNumberMargin) E.cx = size + HL_config.LineNumberMargin;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    editorSetStatusMessage("Replaced %zu matches on %d lines in %.1f ms", count, r->nrows,
+    (now.tv_sec - start.tv_sec) * 1e3 + (now.tv_nsec - start.tv_nsec) / 1e6);
+}
+
+void editorReplace() {
+    int saved_cx = E.cx;
+    int saved_cy = E.cy;
+    int saved_coloff = E.coloff;
+    int saved_rowoff = E.rowoff;
+
+    // the query is typed as for Find, matches and all
+    SEARCH.replacing = 1;
+    char *query = editorPrompt(editorFindPrompt(), editorFindCallback, 0);
+    SEARCH.replacing = 0;
+
+    E.cx = saved_cx;
+    E.cy = saved_cy;
+    E.coloff = saved_coloff;
+    E.rowoff = saved_rowoff;
+    if (query == NULL) return;
+
+    char *with = editorPrompt("Replace with: %s (ESC to cancel)", NULL, PROMPT_EMPTY_OK);
+    if (with) editorReplaceAll(query, with);
+    free(with);
+    free(query);
+}
+
+/* GO TO LINE */
+
+// returns the row now holding line `line` of the mapped file, or the row
+// that took its place if it was deleted
+int editorRowForSourceLine(int line) {
+    int at = 0;
+    erow *row;
+    for (row = ropeFirst(E.rows); row; row = editorRowNext(row)) {
+        if (row->srcline >= 0 && line < row->srcline + row->lines)
+            return at + (line > row->srcline ? line - row->srcline : 0);
+        at += row->lines;
+    }
+    return at;
+}
+
+void editorJump() {
+    char *query = editorPrompt(E.view.on ? "Go to line: %s (@ for a byte offset, N%% of the file, ESC to cancel)" :
+    "Go to line: %s (@ for a byte offset, ESC to cancel)", NULL, 0);
+    if (query == NULL) return;
+
+    if (E.view.on) {
+        editorViewJump(query);
+        free(query);
+        return;
+    }
+
+    int at, col = 0;
+    if (query[0] == '@') {
+        if (E.src.map == NULL) {
+            free(query);
+            editorSetStatusMessage("No file offsets for this buffer");
             return;
         }
-        
-        editorSelectSyntaxHighlight();
+
+        size_t off = strtoull(&query[1], NULL, 10);
+        int line = editorSourceLineAt(off);
+        at = editorRowForSourceLine(line);
+        col = off - editorSourceOffset(line);
+    } else {
+        at = atoi(query) - 1;
+    }
+    free(query);
+
+    if (at >= E.numrows) at = E.numrows - 1;
+    if (at < 0) at = 0;
+
+    erow *row = editorRowAt(at);
+    if (row == NULL || col > row->size) col = row ? row->size : 0;
+    E.cy = at;
+    E.cx = col + HL_config.LineNumberMargin;
+}
+
+/* APPEND BUUFFER */
+
+/*
+ * The buffer keeps its capacity when len is reset, so the frame buffer only
+ * grows over the first few frames and then never reallocates again.
+ */
+
+struct abuf {
+  char *b;
+  int len;
+  int cap;
+};
+
+#define ABUF_INIT {NULL, 0, 0}
+
+// room for len more bytes at abuf->b + abuf->len, or NULL
+char *abufReserve(struct abuf *abuf, int len) {
+    if (abuf->len + len > abuf->cap) {
+        int cap = abuf->cap ? abuf->cap * 2 : 4096;
+        while (cap < abuf->len + len) cap *= 2;
+
+        char *new = realloc(abuf->b, cap);
+        if (new == NULL) return NULL;
+        abuf->b = new;
+        abuf->cap = cap;
+    }
+    return &abuf->b[abuf->len];
+}
+
+void abufAppend(struct abuf *abuf, const char *s, int len) {
+    char *p = abufReserve(abuf, len);
+
+    if (p == NULL) return;
+
+    memcpy(p, s, len);
+    abuf->len += len;
+}
+
+void abufFree(struct abuf *abuf) {
+  free(abuf->b);
+}
+
+/* JOURNAL */
+
+/*
+ * Every edit is also appended to a journal next to the file, .<name>.kyj,
+ * so unsaved work survives a crash. The main thread only adds records to a
+ * buffer in memory. A writer thread appends the buffer to the journal and
+ * calls fdatasync, then waits JOURNAL_BATCH_MS so that the next sync covers
+ * everything typed in the meantime. The journal begins with the size and
+ * mtime of the file it applies to. Saving or quitting removes it. On open,
+ * a journal that matches the file on disk is offered for replay.
+ */
+
+#define JOURNAL_MAGIC "KAYRAKJ1"
+#define JOURNAL_BATCH_MS (100)
+
+struct journalHeader {
+    char magic[8];
+    uint64_t size;
+    int64_t mtime_sec, mtime_nsec;
+};
+
+struct journalRecord {
+    uint8_t type, flags;
+    uint16_t pad;
+    int32_t y, x;
+    uint32_t len;           // bytes of text that follow
+};
+
+struct editorJournal {
+    pthread_t thread;
+    int started;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int fd;
+    char *path;
+    int failed;             // stop trying after an I/O error
+    struct abuf pending;    // records the writer has not taken yet
+    int busy;               // the writer is writing what it took
+};
+
+struct editorJournal JOURNAL = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .fd = -1,
+    .pending = ABUF_INIT,
+};
+
+char *editorJournalPath(const char *filename) {
+    const char *slash = strrchr(filename, '/');
+    int dirlen = slash ? slash - filename + 1 : 0;
+    char *path = malloc(strlen(filename) + 6);
+    sprintf(path, "%.*s.%s.kyj", dirlen, filename, filename + dirlen);
+    return path;
+}
+
+void *editorJournalMain(void *arg) {
+    struct editorJournal *j = arg;
+    struct abuf out = ABUF_INIT;
+
+    pthread_mutex_lock(&j->lock);
+    for (;;) {
+        while (j->pending.len == 0) pthread_cond_wait(&j->cond, &j->lock);
+
+        struct abuf tmp = out;
+        out = j->pending;
+        j->pending = tmp;
+        j->pending.len = 0;
+        j->busy = 1;
+        pthread_mutex_unlock(&j->lock);
+
+        int err = 0;
+        char *p = out.b;
+        int left = out.len;
+        while (left > 0) {
+            ssize_t n = write(j->fd, p, left);
+            if (n == -1 && errno == EINTR) continue;
+            if (n <= 0) {
+                err = 1;
+                break;
+            }
+            p += n;
+            left -= n;
+        }
+        if (!err && fdatasync(j->fd) == -1) err = 1;
+        out.len = 0;
+
+        pthread_mutex_lock(&j->lock);
+        if (err) j->failed = 1;
+        j->busy = 0;
+        pthread_cond_broadcast(&j->cond);
+
+        // let edits pile up, so one sync covers a burst of them
+        pthread_mutex_unlock(&j->lock);
+        usleep(JOURNAL_BATCH_MS * 1000);
+        pthread_mutex_lock(&j->lock);
+    }
+    return NULL;
+}
+
+// starts a journal for the file as it is on disk now
+static int journalCreate(struct editorJournal *j) {
+    pthread_mutex_lock(&j->lock);
+    int failed = j->failed;
+    pthread_mutex_unlock(&j->lock);
+    if (E.filename == NULL || failed) return -1;
+
+    struct journalHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, JOURNAL_MAGIC, sizeof(h.magic));
+    struct stat st;
+    if (stat(E.filename, &st) == 0) {
+        h.size = st.st_size;
+        h.mtime_sec = st.st_mtim.tv_sec;
+        h.mtime_nsec = st.st_mtim.tv_nsec;
+    }
+
+    free(j->path);
+    j->path = editorJournalPath(E.filename);
+    j->fd = open(j->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (j->fd == -1 || write(j->fd, &h, sizeof(h)) != sizeof(h)) {
+        if (j->fd != -1) close(j->fd);
+        j->fd = -1;
+        j->failed = 1;
+        editorSetStatusMessage("No crash journal: %s", strerror(errno));
+        return -1;
+    }
+
+    if (!j->started) {
+        if (pthread_create(&j->thread, NULL, editorJournalMain, j) != 0) die("pthread_create");
+        pthread_detach(j->thread);
+        j->started = 1;
+    }
+    return 0;
+}
+
+void editorJournalAppend(int type, int y, int x, const char *s, int len, int flags) {
+    struct editorJournal *j = &JOURNAL;
+    if (j->fd == -1 && journalCreate(j) == -1) return;
+
+    struct journalRecord rec = { type, flags, 0, y, x, len };
+    pthread_mutex_lock(&j->lock);
+    abufAppend(&j->pending, (char *)&rec, sizeof(rec));
+    abufAppend(&j->pending, s, len);
+    pthread_cond_broadcast(&j->cond);
+    pthread_mutex_unlock(&j->lock);
+}
+
+// drops the journal once the buffer matches the file again, or is thrown away
+void editorJournalRemove() {
+    struct editorJournal *j = &JOURNAL;
+
+    pthread_mutex_lock(&j->lock);
+    j->pending.len = 0;
+    while (j->busy) pthread_cond_wait(&j->cond, &j->lock);
+    if (j->fd != -1) {
+        close(j->fd);
+        unlink(j->path);
+        j->fd = -1;
     }
-    
-    int len;
-    char *buf = editorRowsToString(&len);
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);  
-    if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
-            }
-        }
-        close(fd);
+    j->failed = 0;
+    pthread_mutex_unlock(&j->lock);
+}
+
+/*
+ * Offers to replay the journal left by a session that never saved or quit.
+ * Replayed edits are logged for undo and journaled again like typed ones.
+ */
+// where the whole records in a journal of `size` bytes end, and how many there are
+static size_t journalRecords(const char *map, size_t size, int *n) {
+    size_t end = sizeof(struct journalHeader);
+
+    // a crash can cut the last one short
+    *n = 0;
+    while (end + sizeof(struct journalRecord) <= size) {
+        struct journalRecord rec;
+        memcpy(&rec, map + end, sizeof(rec));
+        if (end + sizeof(rec) + rec.len > size) break;
+        end += sizeof(rec) + rec.len;
+        (*n)++;
     }
+    return end;
+}
 
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+/*
+ * Applies the whole records in map[sizeof(struct journalHeader), end), in
+ * order, up to the first one that does not fit the buffer. Returns how many
+ * it applied.
+ */
+static int journalReplay(const char *map, size_t end) {
+    size_t off = sizeof(struct journalHeader);
+    int done = 0;
+
+    while (off < end) {
+        struct journalRecord rec;
+        memcpy(&rec, map + off, sizeof(rec));
+        const char *text = map + off + sizeof(rec);
+        off += sizeof(rec) + rec.len;
+
+        if (!editorEditValid(rec.type, rec.y, rec.x, text, rec.len, rec.flags)) break;
+        editorUndoRecord(rec.type, rec.y, rec.x, text, rec.len, rec.flags);
+        E.undo.applying = 1;
+        editorApplyEdit(rec.type, rec.y, rec.x, text, rec.len, rec.flags);
+        E.undo.applying = 0;
+        done++;
+    }
+    return done;
 }
 
-void editorSetConfig(){
-    FILE *fp = fopen("config.txt", "r");
-    if(!fp) die("fopen");
+void editorJournalOffer() {
+    char *path = editorJournalPath(E.filename);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        free(path);
+        return;
+    }
 
-    char *line = NULL;
-    size_t linecap = 0;
-    size_t linelen;
-    size_t linesep;
-    size_t linenum = 0;// matchcolor=123
-    
-    while ((linelen = getline(&line, &linecap, fp)) != -1){
-        while (linelen > 0 && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-            linelen--;
+    // the journal's edits are placed against the whole file
+    if (editorLoading()) {
+        editorSetStatusMessage("Loading %s to recover unsaved edits...", E.filename);
+        editorRefreshScreen();
+        editorLoadWait();
+        if (E.filename == NULL) {
+            close(fd);
+            free(path);
+            return;
+        }
+    }
 
-        int i;
-        for (i = 0; i < linelen; i++){
-            if(line[i] == '='){ 
-                linesep = i;
-                break;  
-            }
+    // read, not mapped: replaying starts a new journal under the same name
+    struct stat st, jst;
+    struct journalHeader h;
+    char *map = NULL;
+    if (fstat(fd, &jst) == 0 && jst.st_size >= (off_t)sizeof(h)) {
+        map = malloc(jst.st_size);
+        if (map && read(fd, map, jst.st_size) != jst.st_size) {
+            free(map);
+            map = NULL;
         }
-        
-        linenum++;
-        char *sep = strchr(line, '=');
-        if (sep == NULL) continue;
+    }
+    close(fd);
+    if (map == NULL) {
+        free(path);
+        return;
+    }
+    memcpy(&h, map, sizeof(h));
+
+    if (memcmp(h.magic, JOURNAL_MAGIC, sizeof(h.magic)) != 0 ||
+        stat(E.filename, &st) == -1 || (uint64_t)st.st_size != h.size ||
+        st.st_mtim.tv_sec != h.mtime_sec || st.st_mtim.tv_nsec != h.mtime_nsec) {
+        editorSetStatusMessage("Journal %s is for another version of the file; ignored", path);
+        free(map);
+        free(path);
+        return;
+    }
 
-        *sep = '\0';
-        //char *key = line;
-        char *strvalue = sep + 1;
+    int n;
+    size_t end = journalRecords(map, jst.st_size, &n);
 
-        int value = atoi(strvalue);
+    // only a plain n throws the edits away; Esc sets them aside for later
+    int c;
+    do {
+        editorSetStatusMessage("%s has %d unsaved edits from a crashed session. Replay them? (y/n, ESC to keep for later)",
+        E.filename, n);
+        editorRefreshScreen();
+        c = editorReadKey();
+    } while (c != 'y' && c != 'Y' && c != 'n' && c != 'N' && c != '\x1b');
 
-        switch (linenum){
-            case 1:
-                HL_config.LineNumberMargin = value;
-                break;
-            case 2:
-                HL_config.TabStop = value;
-                break;
-            case 3:
-                HL_config.ConfirmQuitTimes = value;
-                break;
-            case 4:
-                HL_config.KeywordColor = value;
-                break;
-            case 5:
-                HL_config.VariableColor = value;
-                break;
-            case 6:
-                HL_config.CommentColor = value;
-                break;
-            case 7:
-                HL_config.MultilineCommentColor = value;
-                break;
-            case 8:
-                HL_config.StringColor = value;
-                break;
-            case 9:
-                HL_config.NumberColor = value;
-                break;
-            case 10:
-                HL_config.MatchColor = value;
-                break;
-            case 11:
-                HL_config.DefaultColor = value;
-                break;
-        }
+    int done = 0;
+    if (c == '\x1b') {
+        // a new journal would be written over this one
+        pthread_mutex_lock(&JOURNAL.lock);
+        JOURNAL.failed = 1;
+        pthread_mutex_unlock(&JOURNAL.lock);
+        editorSetStatusMessage("Journal kept in %s; this session is not journaled", path);
+    } else if (c == 'y' || c == 'Y') {
+        done = journalReplay(map, end);
+        editorSetStatusMessage("Replayed %d of %d edits", done, n);
+    } else {
+        unlink(path);
+        editorSetStatusMessage("Journal discarded");
     }
-    
-    free(line);
-    fclose(fp);
+    free(map);
+    free(path);
 }
 
-/* SEARCH */
+/* SCREEN */
 
-void editorFindCallback(char *query, int key) {
-    static int last_match = -1;
-    static int direction = 1;
+/*
+ * A frame is drawn into a grid of cells first. editorFlushScreen then compares
+ * the grid with a shadow of what the terminal already shows and sends only
+ * the runs of cells that changed. When the view moved up or down by less than
+ * a screen, the text area is scrolled first with \x1b[S / \x1b[T inside a
+ * scroll region, and the shadow is moved the same way. After that, only the
+ * lines that scrolled into view still differ.
+ */
+
+#define SCREEN_RUN_GAP (8)  // unchanged cells worth resending to save a jump
+
+static const struct cell blankCell = {' ', 0, -1, -1};
+
+void screenInit(int rows, int cols) {
+    struct editorScreen *s = &E.screen;
+    s->rows = rows;
+    s->cols = cols;
+    s->frame = malloc(sizeof(struct cell) * rows * cols);
+    s->shadow = malloc(sizeof(struct cell) * rows * cols);
+    if (s->frame == NULL || s->shadow == NULL) die("malloc");
+    s->valid = 0;
+}
 
-    static int saved_hl_line;
-    static char *saved_hl = NULL;
+static int cellEqual(const struct cell *a, const struct cell *b) {
+    return a->c == b->c && a->attr == b->attr && a->fg == b->fg && a->bg == b->bg;
+}
 
-    if (saved_hl) {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
+void screenClearLine(int y, unsigned char attr) {
+    struct cell *line = &E.screen.frame[y * E.screen.cols];
+    int x;
+    for (x = 0; x < E.screen.cols; x++) {
+        line[x] = blankCell;
+        line[x].attr = attr;
     }
+}
 
-    
-    if (key == '\r' || key == '\x1b') {
-        last_match = -1;
-        direction = 1;
-        return;
-    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-        direction = 1;
-    } else if (key == ARROW_LEFT || key == ARROW_UP) {
-        direction = -1;
-    } else {
-        last_match = -1;
-        direction = 1;
-    }
-    
-    if (last_match == -1) direction = 1;
-    
-    int current = last_match;
+// puts len bytes at (y, x) in the frame, clipped to the line; returns the next x
+int screenPut(int y, int x, const char *s, int len, int fg, int bg, unsigned char attr) {
+    struct cell *line = &E.screen.frame[y * E.screen.cols];
     int i;
-    for (i = 0; i < E.numrows; i++) {
-        current += direction;
-        
-        if (current == -1) current = E.numrows - 1;
-        else if (current == E.numrows) current = 0;
-        
-        erow *row = &E.row[current];
-        char *match = strstr(row->render, query);
-        
-        if (match) {
-            last_match = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render) + HL_config.LineNumberMargin;
-            E.rowoff = E.numrows;
-
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
-        }
+    for (i = 0; i < len && x < E.screen.cols; i++, x++) {
+        line[x].c = s[i];
+        line[x].attr = attr;
+        line[x].fg = fg;
+        line[x].bg = bg;
     }
+    return x;
 }
 
-void editorFind() {  
-    int saved_cx = E.cx;
-    int saved_cy = E.cy;
-    int saved_coloff = E.coloff;
-    int saved_rowoff = E.rowoff;
-    
-    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
-    
-    if (query) {
-        free(query);
-    } else {
-        E.cx = saved_cx;
-        E.cy = saved_cy;
-        E.coloff = saved_coloff;
-        E.rowoff = saved_rowoff;
+// brings the terminal's attributes from *cur to those of want, by the shorter
+// of changing just what differs or resetting and setting what is left
+static void screenSGR(struct abuf *ab, struct cell *cur, const struct cell *want) {
+    if (cur->attr == want->attr && cur->fg == want->fg && cur->bg == want->bg) return;
+
+    char delta[48], reset[48];
+    int dlen = 0, rlen = 1;
+    reset[0] = '0';
+    if (want->attr & CELL_REVERSE) rlen += sprintf(reset + rlen, ";7");
+    if (want->fg >= 0) rlen += sprintf(reset + rlen, ";38;5;%d", want->fg);
+    if (want->bg >= 0) rlen += sprintf(reset + rlen, ";48;5;%d", want->bg);
+
+    if (cur->attr != want->attr)
+        dlen += sprintf(delta + dlen, (want->attr & CELL_REVERSE) ? ";7" : ";27");
+    if (cur->fg != want->fg)
+        dlen += want->fg >= 0 ? sprintf(delta + dlen, ";38;5;%d", want->fg) : sprintf(delta + dlen, ";39");
+    if (cur->bg != want->bg)
+        dlen += want->bg >= 0 ? sprintf(delta + dlen, ";48;5;%d", want->bg) : sprintf(delta + dlen, ";49");
+
+    // a bare \x1b[m resets everything
+    char *params = reset;
+    int len = rlen == 1 ? 0 : rlen;
+    if (dlen - 1 < len) {
+        params = delta + 1;
+        len = dlen - 1;
     }
+
+    char *p = abufReserve(ab, len + 3);
+    if (p == NULL) return;
+    p[0] = '\x1b';
+    p[1] = '[';
+    memcpy(p + 2, params, len);
+    p[len + 2] = 'm';
+    ab->len += len + 3;
+
+    cur->attr = want->attr;
+    cur->fg = want->fg;
+    cur->bg = want->bg;
 }
 
-/* APPEND BUUFFER */
+// sends the cells in [from, to) of a line, one copy per run of the same attributes
+static void screenEmit(struct abuf *ab, struct cell *cur, const struct cell *line, int from, int to) {
+    while (from < to) {
+        const struct cell *c = &line[from];
+        int n = 1;
+        while (from + n < to && c[n].attr == c->attr && c[n].fg == c->fg && c[n].bg == c->bg) n++;
 
-struct abuf {
-  char *b;
-  int len;
-};
+        screenSGR(ab, cur, c);
+        char *p = abufReserve(ab, n);
+        if (p == NULL) return;
+        int i;
+        for (i = 0; i < n; i++) p[i] = c[i].c;
+        ab->len += n;
+        from += n;
+    }
+}
 
-#define ABUF_INIT {NULL, 0}
+static void screenMoveTo(struct abuf *ab, int y, int x) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+    abufAppend(ab, buf, len);
+}
 
-void abufAppend(struct abuf *abuf, const char *s, int len) {
-    char *new = realloc(abuf->b, abuf->len + len);
-    
-    if (new == NULL) return;
-    
-    memcpy(&new[abuf->len], s, len);
-    abuf->b = new;
-    abuf->len += len;
+// a line's length without its trailing blanks
+static int screenLineEnd(const struct cell *line, int cols) {
+    while (cols > 0 && cellEqual(&line[cols - 1], &blankCell)) cols--;
+    return cols;
 }
 
-void abufFree(struct abuf *abuf) {
-  free(abuf->b);
+void editorFlushScreen(struct abuf *ab, int textrows) {
+    struct editorScreen *s = &E.screen;
+    int cols = s->cols;
+
+    int d = E.rowoff - s->rowoff;
+    if (s->valid && d != 0 && abs(d) < textrows && E.coloff == s->coloff) {
+        char buf[48];
+        int len = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r",
+        textrows, abs(d), d > 0 ? 'S' : 'T');
+        abufAppend(ab, buf, len);
+
+        struct cell *exposed;
+        if (d > 0) {
+            memmove(s->shadow, s->shadow + d * cols, sizeof(struct cell) * (textrows - d) * cols);
+            exposed = s->shadow + (textrows - d) * cols;
+        } else {
+            memmove(s->shadow - d * cols, s->shadow, sizeof(struct cell) * (textrows + d) * cols);
+            exposed = s->shadow;
+        }
+        int i;
+        for (i = 0; i < abs(d) * cols; i++) exposed[i] = blankCell;
+    }
+    s->rowoff = E.rowoff;
+    s->coloff = E.coloff;
+
+    struct cell cur = blankCell;
+    int y;
+    for (y = 0; y < s->rows; y++) {
+        struct cell *line = &s->frame[y * cols];
+        struct cell *old = &s->shadow[y * cols];
+        if (s->valid && memcmp(line, old, sizeof(struct cell) * cols) == 0) continue;
+
+        int end = screenLineEnd(line, cols);
+        int oldend = s->valid ? screenLineEnd(old, cols) : cols;
+
+        // bytes past ASCII may not be one column each, so such lines are sent whole
+        int whole = !s->valid;
+        int x;
+        for (x = 0; x < end && !whole; x++) whole = (unsigned char)line[x].c >= 0x80;
+        for (x = 0; x < oldend && !whole; x++) whole = (unsigned char)old[x].c >= 0x80;
+
+        if (whole) {
+            screenMoveTo(ab, y, 0);
+            screenEmit(ab, &cur, line, 0, end);
+            if (end < cols) {
+                screenSGR(ab, &cur, &blankCell);
+                abufAppend(ab, "\x1b[K", 3);
+            }
+            continue;
+        }
+
+        int at = -1;    // where the terminal's cursor is on this line
+        x = 0;
+        while (x < end) {
+            if (cellEqual(&line[x], &old[x])) {
+                x++;
+                continue;
+            }
+
+            // a run ends once SCREEN_RUN_GAP cells in a row already match
+            int run = x + 1, i;
+            for (i = run; i < end && i - run < SCREEN_RUN_GAP; i++)
+                if (!cellEqual(&line[i], &old[i])) run = i + 1;
+
+            if (at != x) screenMoveTo(ab, y, x);
+            screenEmit(ab, &cur, line, x, run);
+            x = run;
+            at = x < cols ? x : -1;
+        }
+        if (oldend > end) {
+            if (at != end) screenMoveTo(ab, y, end);
+            screenSGR(ab, &cur, &blankCell);
+            abufAppend(ab, "\x1b[K", 3);
+        }
+    }
+    screenSGR(ab, &cur, &blankCell);
+
+    memcpy(s->shadow, s->frame, sizeof(struct cell) * s->rows * cols);
+    s->valid = 1;
 }
 
 /* OUTPUT */
@@ -846,7 +6411,8 @@ void abufFree(struct abuf *abuf) {
 void editorScroll() {
     E.rx = E.cx;
     if (E.cy < E.numrows) {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+        E.rx = HL_config.LineNumberMargin +
+            editorRowCxToRx(editorRowAt(E.cy), E.cx - HL_config.LineNumberMargin);
     }
 
     if (E.cy < E.rowoff) {
@@ -864,146 +6430,189 @@ void editorScroll() {
     }
 }
 
-void editorDrawRows(struct abuf *abuf){
+// marks the render columns [from, to) of a row in `over`, which starts at E.coloff
+static void editorDrawOver(unsigned char *over, int len, int from, int to, unsigned char mark) {
+    from -= E.coloff;
+    to -= E.coloff;
+    if (from < 0) from = 0;
+    if (to > len) to = len;
+    if (from < to) memset(&over[from], mark, to - from);
+}
+
+void editorDrawRows(){
+    static unsigned char *over;     // per column: 0, or 1 on a match, 2 on the cursor's
+    static int overcap;
     int y;
+    for (y = 0; y < E.screenrows && y + E.rowoff < E.numrows; y++)
+        editorRowAt(y + E.rowoff);
+    editorSyntaxSync(E.rowoff + y - 1, 1);
+
+    if (overcap < E.screencolumns) {
+        overcap = E.screencolumns;
+        over = realloc(over, overcap);
+        if (over == NULL) die("realloc");
+    }
+    SEARCH.frame++;
+
     for (y = 0; y < E.screenrows; y++) {
         int filerow = y + E.rowoff;
+        erow *row = editorRowAt(filerow);
+        screenClearLine(y, 0);
         if (filerow >= E.numrows){
             if (y == E.screenrows / 3 && E.numrows == 0) {
                 char welcome[80];
-                
+
                 int welcomelen = snprintf(welcome, sizeof(welcome),
                 "KAYRAK editor -- version %s", KAYRAK_VERSION);
                 if (welcomelen > E.screencolumns) welcomelen = E.screencolumns;
 
                 int centerPadding = (E.screencolumns - welcomelen) / 2;
-                if(centerPadding){
-                    abufAppend(abuf, "\x1b[38;5;242m", 11);
-                    abufAppend(abuf, ">", 1);
-                    abufAppend(abuf, "\x1b[39m", 5);
-                    centerPadding--;
-                }
-            
-                while (centerPadding--) abufAppend(abuf, " ", 1);
-                abufAppend(abuf, welcome, welcomelen);
-            } else {
-                abufAppend(abuf, "\x1b[38;5;242m", 11);
-                abufAppend(abuf, ">", 1);
-                abufAppend(abuf, "\x1b[39m", 5);
+                if(centerPadding) screenPut(y, 0, ">", 1, 242, -1, 0);
 
-            }   
+                screenPut(y, centerPadding, welcome, welcomelen, -1, -1, 0);
+            } else {
+                screenPut(y, 0, ">", 1, 242, -1, 0);
+            }
         }else{
-            int len = E.row[filerow].rsize - E.coloff;
+            int len = row->rsize - E.coloff;
             if(len < 0) len = 0;
-            if (len > E.screencolumns) len = E.screencolumns;   
-            char *c = &E.row[filerow].render[E.coloff];
+            if (len > E.screencolumns) len = E.screencolumns;
+            int p = editorRowRenderRange(row, E.coloff, E.coloff + len);
+            char *c = &row->render[p];
 
             char linenum[50];
-            sprintf(linenum, "%d", filerow + 1);
+            if (E.view.on)
+                sprintf(linenum, "%s%ld", E.view.exact ? "" : "~", E.view.firstline + filerow + 1);
+            else
+                sprintf(linenum, "%d", filerow + 1);
             int i;
             for(i = strlen(linenum); i < HL_config.LineNumberMargin; i++)    linenum[i] = ' ';
             linenum[i] = '\0';
-            abufAppend(abuf, "\x1b[38;5;242m", 11);
-            abufAppend(abuf, linenum, HL_config.LineNumberMargin);
-            abufAppend(abuf, "\x1b[39m", 5);
+            int x = screenPut(y, 0, linenum, HL_config.LineNumberMargin, 242, -1, 0);
+
+            // Find's matches go over hl, see searchShownRow
+            const struct searchShown *shown = searchShownRow(row);
+            memset(over, 0, len);
+            if (shown) {
+                for (i = 0; i < shown->n && shown->spans[i] < E.coloff + len; i += 2)
+                    editorDrawOver(over, len, shown->spans[i], shown->spans[i + 1], 1);
+            }
+            if (filerow == SEARCH.marky) {
+                editorDrawOver(over, len, editorRowCxToRx(row, SEARCH.markx),
+                    editorRowCxToRx(row, SEARCH.markx + SEARCH.marklen), 2);
+            }
 
-            unsigned char *hl = &E.row[filerow].hl[E.coloff];
-            int current_color = -1;
-            int j;
-            for (j = 0; j < len; j++) {
-                if (hl[j] == HL_NORMAL) {          
-                    if (current_color != -1) {
-                        abufAppend(abuf, "\x1b[39m", 5);
-                        current_color = -1;
-                    }
-                    abufAppend(abuf, &c[j], 1);
-                } else {
-                    int color = editorSyntaxToColor(hl[j]);
-                    if(current_color != color){
-                        current_color = color;
-                        char buf[16];
-                        int clen;
-                        if(hl[j] == HL_MATCH){
-                            clen = snprintf(buf, sizeof(buf), "\x1b[48;5;%dm", color);
-                        } else{
-                            clen = snprintf(buf, sizeof(buf), "\x1b[38;5;%dm", color);
-                        }
-                        abufAppend(abuf, buf, clen);
-                    }
-                    abufAppend(abuf, &c[j], 1);
-                }
+            unsigned char *hl = &row->hl[p];
+            int j, n;
+            for (j = 0; j < len; j += n) {
+                for (n = 1; j + n < len && hl[j + n] == hl[j] && over[j + n] == over[j]; n++);
+
+                int fg = -1, bg = -1;
+                if (over[j]) bg = editorSyntaxToColor(HL_MATCH);
+                else if (hl[j] != HL_NORMAL) fg = editorSyntaxToColor(hl[j]);
+                x = screenPut(y, x, &c[j], n, fg, bg, over[j] == 2 ? CELL_REVERSE : 0);
             }
-            abufAppend(abuf, "\x1b[39m", 5);
-            abufAppend(abuf, "\x1b[48;5;m", 8);
         }
-        
-        
-        abufAppend(abuf, "\x1b[K", 3);
-        abufAppend(abuf, "\r\n", 2);
     }
 }
 
-void editorDrawStatusBar(struct abuf *abuf) {  
-    abufAppend(abuf, "\x1b[7m", 4);
-    
-    char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-    E.filename ? E.filename : "[Unnamed]", E.numrows,
-    E.dirty ? "[Modified]" : "");
+void editorDrawStatusBar() {
+    int y = E.screenrows;
+    screenClearLine(y, CELL_REVERSE);
 
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d:%d",
-    E.syntax ? E.syntax->filetype : "no ft", E.cx - HL_config.LineNumberMargin, E.cy + 1);
-    
-    if (len > E.screencolumns) len = E.screencolumns;
-    
-    abufAppend(abuf, status, len);
-    
-    while (len < E.screencolumns) {
-        if (E.screencolumns - len == rlen) {
-            abufAppend(abuf, rstatus, rlen);
-            break;
-        } else {
-            abufAppend(abuf, " ", 1);
-            len++;
-        }
+    char status[80], rstatus[120];
+    int len;
+    long line = E.cy + 1;
+    const char *approx = "";
+    if (E.view.on) {
+        int exact;
+        long lines = editorViewLines(&exact);
+        len = snprintf(status, sizeof(status), "%.20s - %s%ld lines [view%s]",
+        E.filename, exact ? "" : "~", lines, E.follow.on ? ", follow" : "");
+        line += E.view.firstline;
+        if (!E.view.exact) approx = "~";
+    } else {
+        len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+        E.filename ? E.filename : "[Unnamed]", E.numrows,
+        E.follow.on ? "[follow]" : E.dirty ? "[Modified]" : "");
     }
-    
-    abufAppend(abuf, "\x1b[m", 3);
-    abufAppend(abuf, "\r\n", 2);
+
+    // byte offset of the cursor in the file on disk, from the line index
+    char offset[32] = "";
+    int off;
+    erow *row = ropeFind(E.cy, &off);
+    if (E.view.on)
+        snprintf(offset, sizeof(offset), " @%zu", editorViewOffset(E.cy, E.cx));
+    else if (row && row->srcline >= 0)
+        snprintf(offset, sizeof(offset), " @%zu",
+        editorSourceOffset(row->srcline + off) + E.cx - HL_config.LineNumberMargin);
+
+    // what the previous frame cost to send, see editorFlushScreen
+    char frame[40] = "";
+    if (HL_config.FrameStats)
+        snprintf(frame, sizeof(frame), " | %zuB/frame", E.screen.framebytes);
+
+    char loading[24] = "";
+    if (editorLoading())
+        snprintf(loading, sizeof(loading), " | loading %d%%", editorLoadProgress());
+
+    // while Find is open, see editorSearchIndex
+    char matches[48] = "";
+    if (editorSearchPending())
+        snprintf(matches, sizeof(matches), " | %zu matches, %d%%",
+        SEARCH.count, SEARCH.taken * 100 / SEARCH.nranges);
+    else if (SEARCH.valid && SEARCH.cur)
+        snprintf(matches, sizeof(matches), " | match %zu of %zu", SEARCH.cur, SEARCH.count);
+    else if (SEARCH.valid && SEARCH.needle.len)
+        snprintf(matches, sizeof(matches), " | %zu matches", SEARCH.count);
+    else if (SEARCH.valid && SEARCH.err)
+        snprintf(matches, sizeof(matches), " | regex: %s", SEARCH.err);
+
+    int crlf = E.src.crlf && E.src.crlf * 2 >= E.src.lf;
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s | %d:%s%ld%s%s%s%s",
+    E.syntax ? E.syntax->filetype : "no ft", crlf ? " crlf" : "",
+    E.cx - HL_config.LineNumberMargin, approx, line, offset, matches, loading, frame);
+
+    if (len > E.screencolumns) len = E.screencolumns;
+
+    screenPut(y, 0, status, len, -1, -1, CELL_REVERSE);
+    if (E.screencolumns - len >= rlen)
+        screenPut(y, E.screencolumns - rlen, rstatus, rlen, -1, -1, CELL_REVERSE);
 }
 
-void editorDrawMessageBar(struct abuf *abuf) {
-    abufAppend(abuf, "\x1b[K", 3);
-    
+void editorDrawMessageBar() {
+    int y = E.screenrows + 1;
+    screenClearLine(y, 0);
+
     int msglen = strlen(E.statusmsg);
     if (msglen > E.screencolumns) msglen = E.screencolumns;
-    
+
     if (msglen && time(NULL) - E.statusmsg_time < 10)
-        abufAppend(abuf, E.statusmsg, msglen);
+        screenPut(y, 0, E.statusmsg, msglen, -1, -1, 0);
 }
 
-void editorRefreshScreen() {  
+void editorRefreshScreen() {
     editorScroll();
 
-    struct abuf ab = ABUF_INIT;
+    editorDrawRows();
+    editorDrawStatusBar();
+    editorDrawMessageBar();
+
+    static struct abuf ab = ABUF_INIT;
+    ab.len = 0;
+
+    abufAppend(&ab, "\x1b[?25l", 6);  //hide cursor
+    editorFlushScreen(&ab, E.screenrows);
 
-    abufAppend(&ab, "\x1b[?25l", 6);  //hide cursor 
-    //abufAppend(&ab, "\x1b[2J", 4);    //erase everything on screen
-    abufAppend(&ab, "\x1b[H", 3);
-    
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
-    
     char buf[32];
     snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cy - E.rowoff + 1, E.rx - E.coloff + 1);
     abufAppend(&ab, buf, strlen(buf));
 
     abufAppend(&ab, "\x1b[?25h", 6);  //show cursor
-    
+
     write(STDOUT_FILENO, ab.b, ab.len);
-    
-    abufFree(&ab);
+    E.screen.framebytes = ab.len;
+    E.screen.totalbytes += ab.len;
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -1016,7 +6625,7 @@ void editorSetStatusMessage(const char *fmt, ...) {
 
 /* INPUT */
 
-char *editorPrompt(char *prompt, void (*callback)(char *, int)){
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int flags){
     size_t bufsize = 128;
     char *buf = malloc(bufsize);
     size_t buflen = 0;
@@ -1024,7 +6633,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)){
     buf[0] = '\0';
     while (1) {
         editorSetStatusMessage(prompt, buf);
-        editorRefreshScreen();
+        if (!editorKeyPending()) editorRefreshScreen();
 
         int c = editorReadKey();    
         if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
@@ -1035,11 +6644,25 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)){
             free(buf);
             return NULL;
         } else if (c == '\r') {
-            if (buflen != 0) {
+            if (buflen != 0 || (flags & PROMPT_EMPTY_OK)) {
                 editorSetStatusMessage("");
                 if (callback) callback(buf, c);
                 return buf;
             }
+        } else if (c == PASTE_KEY) {
+            // the first line of it, as plain text
+            size_t i;
+            for (i = 0; i < E.input.pastelen; i++) {
+                char ch = E.input.paste[i];
+                if (ch == '\r' || ch == '\n') break;
+                if (iscntrl(ch) || (unsigned char)ch >= 128) continue;
+                if (buflen == bufsize - 1) {
+                    bufsize *= 2;
+                    buf = realloc(buf, bufsize);
+                }
+                buf[buflen++] = ch;
+                buf[buflen] = '\0';
+            }
         } else if (!iscntrl(c) && c < 128) {
             if (buflen == bufsize - 1) {
                 bufsize *= 2;
@@ -1054,7 +6677,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int)){
 }
 
 void editorMoveCursor(int key){
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    erow *row = editorRowAt(E.cy);
 
     switch (key){
     case ARROW_UP:
@@ -1064,7 +6687,7 @@ void editorMoveCursor(int key){
         if(E.cx > HL_config.LineNumberMargin) E.cx--;
         else if(E.cy > 0){
             E.cy--;
-            E.cx = E.row[E.cy].size + HL_config.LineNumberMargin;
+            E.cx = editorRowAt(E.cy)->size + HL_config.LineNumberMargin;
         }
         break;
     case ARROW_DOWN:
@@ -1079,7 +6702,7 @@ void editorMoveCursor(int key){
         break;
     }
 
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    row = editorRowAt(E.cy);
     int rowlen = (row ? row->size : 0) + HL_config.LineNumberMargin;
     if (E.cx > rowlen) {
         E.cx = rowlen;
@@ -1087,11 +6710,46 @@ void editorMoveCursor(int key){
     
 }
 
+// keys that change the text or write it out
+int editorKeyEdits(int c) {
+    switch (c) {
+        case CTRL_KEY('q'):
+        case CTRL_KEY('f'):
+        case CTRL_KEY('g'):
+        case CTRL_KEY('r'):
+        case CTRL_KEY('l'):
+        case '\x1b':
+        case HOME_KEY:
+        case END_KEY:
+        case PAGE_UP:
+        case PAGE_DOWN:
+        case ARROW_UP:
+        case ARROW_DOWN:
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+            return 0;
+    }
+    return 1;
+}
+
 void editorProcessKeypress() {
     int quit_times = HL_config.ConfirmQuitTimes;
 
     int c = editorReadKey();
 
+    // renaming is harmless while loading, but would point a view or a follow at another file
+    if ((E.view.on || E.follow.on) && (editorKeyEdits(c) || c == CTRL_KEY('r'))) {
+        editorSetStatusMessage(E.view.on ? "Read-only view (-R)" : "Read-only while following (-F)");
+        return;
+    }
+
+    // the rows are still coming in behind the loaded part, so it stays as it is
+    if (editorLoading() && editorKeyEdits(c)) {
+        editorSetStatusMessage("Still loading (%d%%), press ESC to stop and edit what is loaded",
+        editorLoadProgress());
+        return;
+    }
+
     switch (c) {
         case '\r':
             editorInsertNewline();
@@ -1099,6 +6757,9 @@ void editorProcessKeypress() {
         case '\t':
             editorInsertTab();
             break;
+        case PASTE_KEY:
+            editorInsertText(E.input.paste, E.input.pastelen);
+            break;
         case CTRL_KEY('q'):      
             if (E.dirty && quit_times > 0) {
                 editorSetStatusMessage("WARNING!!! File has unsaved changes. "
@@ -1106,6 +6767,7 @@ void editorProcessKeypress() {
                 quit_times--;
                 return;
             }
+            editorJournalRemove();
             write(STDOUT_FILENO, "\x1b[2J", 4);
             write(STDOUT_FILENO, "\x1b[H", 3);
             exit(0);
@@ -1116,15 +6778,27 @@ void editorProcessKeypress() {
         case CTRL_KEY('f'):
             editorFind();
             break;
+        case CTRL_KEY('g'):
+            editorJump();
+            break;
+        case CTRL_KEY('t'):
+            editorReplace();
+            break;
+        case CTRL_KEY('z'):
+            editorUndo();
+            break;
+        case CTRL_KEY('y'):
+            editorRedo();
+            break;
         case CTRL_KEY('r'):
-            E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+            E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL, 0);
             break;
         case HOME_KEY:
-            E.cx = 0;
+            E.cx = HL_config.LineNumberMargin;
             break;
         case END_KEY:
             if (E.cy < E.numrows)
-                E.cx = E.row[E.cy].size;
+                E.cx = editorRowAt(E.cy)->size + HL_config.LineNumberMargin;
             break;
         case BACKSPACE:
         case CTRL_KEY('h'):
@@ -1135,6 +6809,8 @@ void editorProcessKeypress() {
         case PAGE_UP:
         case PAGE_DOWN:
             {
+                // rowoff is only brought up to date when a frame is drawn
+                editorScroll();
                 if (c == PAGE_UP) {
                 E.cy = E.rowoff;
                 } else if (c == PAGE_DOWN) {
@@ -1152,13 +6828,16 @@ void editorProcessKeypress() {
         case ARROW_RIGHT:
             editorMoveCursor(c);
             break;
-        case CTRL_KEY('l'):
         case '\x1b':
+            editorLoadCancel();
+            break;
+        case CTRL_KEY('l'):
             break;
         default:
             editorInsertChar(c);
             break;
   }
+  editorViewSlide();
 
   quit_times = HL_config.ConfirmQuitTimes;
 }
@@ -1166,36 +6845,62 @@ void editorProcessKeypress() {
 /* INIT */
 
 void initEditor(){
+    editorSetConfig();
+
     E.cx = HL_config.LineNumberMargin;
     E.cy = 0;
     E.rx = 0;
     E.numrows = 0;
     E.rowoff = 0;
     E.coloff = 0;
-    E.row = NULL;
+    E.rows = NULL;
     E.dirty = 0;
+    E.dirtyrow = INT_MAX;
+    E.hlline = 0;
     E.filename = NULL;
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
     E.syntax = NULL;
+    editorMapGuard();
     
     if (getTermianlSize(&E.screenrows, &E.screencolumns) == -1) die("getTerminalSize");
+    screenInit(E.screenrows, E.screencolumns);
     E.screenrows -= 2;
-
-    editorSetConfig();
 }
 
 int main(int argc, char *argv[]) {
     enableRawMode();
     initEditor();
-    if(argc >= 2){
-        editorOpen(argv[1]);
+
+    // kayrak [-R] [-F] [file]
+    int view = 0, follow = 0, arg = 1;
+    for (; arg < argc && argv[arg][0] == '-' && argv[arg][1]; arg++) {
+        if (strcmp(argv[arg], "-R") == 0) view = 1;
+        else if (strcmp(argv[arg], "-F") == 0) follow = 1;
+        else break;
+    }
+    if (arg < argc) {
+        if (view) editorView(argv[arg]);
+        else editorOpen(argv[arg]);
+        if (follow) editorFollow(argv[arg]);
     }
 
-    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-R = rename");
+    if (E.view.on) {
+        editorSetStatusMessage("HELP: read-only view | Ctrl-Q = quit | Ctrl-F = find | Ctrl-G = go to line, @offset or N%%");
+    } else if (E.follow.on) {
+        editorSetStatusMessage("HELP: following, read-only | Ctrl-Q = quit | Ctrl-F = find | Ctrl-G = go to");
+    } else {
+        editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-G = go to | Ctrl-T = replace | Ctrl-R = rename | Ctrl-Z/Y = undo/redo");
+        if (E.filename) editorJournalOffer();
+    }
     
+    // one frame per batch of keys read together
     while (1) {
-        editorRefreshScreen();
+        if (!editorKeyPending()) {
+            editorRefreshScreen();
+            // drawing reads the lazy rows, so it is what finds a file that shrank
+            if (editorMapCheck()) editorRefreshScreen();
+        }
 
         editorProcessKeypress();
     }
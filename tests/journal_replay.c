@@ -0,0 +1,116 @@
+/*
+ * Checks that replaying a crash journal stops at the first record that does
+ * not fit the buffer, cut short, out of range or naming other text, and
+ * leaves the buffer as the records before it made it.
+ *
+ *   cc -O2 -pthread -o journal_replay tests/journal_replay.c
+ *   ./journal_replay
+ *
+ * Run it from the top of the tree, where config.txt is.
+ */
+
+#define main kayrak_main
+#include "../kayrak.c"
+#undef main
+
+static const char *start[] = { "hello world", "second", "third" };
+
+static void journalStart(struct abuf *j) {
+    struct journalHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, JOURNAL_MAGIC, sizeof(h.magic));
+    *j = (struct abuf)ABUF_INIT;
+    abufAppend(j, (char *)&h, sizeof(h));
+}
+
+static void journalAdd(struct abuf *j, int type, int y, int x, const char *s, int len, int flags) {
+    struct journalRecord rec = { type, flags, 0, y, x, len };
+    abufAppend(j, (char *)&rec, sizeof(rec));
+    abufAppend(j, s, len);
+}
+
+static void bufferReset() {
+    int i;
+    editorFreeRows();
+    for (i = 0; i < (int)(sizeof(start) / sizeof(start[0])); i++)
+        editorInsertRow(E.numrows, (char *)start[i], strlen(start[i]));
+}
+
+// the buffer, rows joined by '|'
+static const char *bufferText() {
+    static char out[256];
+    int i, len = 0;
+    for (i = 0; i < E.numrows; i++) {
+        erow *row = editorRowAt(i);
+        len += snprintf(&out[len], sizeof(out) - len, "%s%.*s", i ? "|" : "", row->size, editorRowChars(row));
+    }
+    return out;
+}
+
+static int bad;
+
+// replays j, cut to `size` bytes if that is not 0, and checks what it did
+static void check(const char *name, struct abuf *j, size_t size, int wantdone, const char *want) {
+    int n;
+    size_t end = journalRecords(j->b, size ? size : (size_t)j->len, &n);
+    int done = journalReplay(j->b, end);
+    const char *got = bufferText();
+
+    if (done != wantdone || strcmp(got, want) != 0) {
+        printf("%s: replayed %d, want %d; buffer \"%s\", want \"%s\"\n", name, done, wantdone, got, want);
+        bad++;
+    }
+    abufFree(j);
+    bufferReset();
+}
+
+int main() {
+    struct abuf j;
+    editorSetConfig();
+    bufferReset();
+
+    journalStart(&j);
+    journalAdd(&j, UNDO_DELETE, 0, 5, " world", 6, 0);
+    journalAdd(&j, UNDO_INSERT, 1, 0, "2nd ", 4, 0);
+    check("fitting records", &j, 0, 2, "hello|2nd second|third");
+
+    journalStart(&j);
+    journalAdd(&j, UNDO_DELETE, 0, 5, " world", 6, 0);
+    journalAdd(&j, UNDO_DELETE, 1, 3, "ond and more", 12, 0);
+    journalAdd(&j, UNDO_INSERT, 0, 0, "x", 1, 0);
+    check("delete past the end of its row", &j, 0, 1, "hello|second|third");
+
+    journalStart(&j);
+    journalAdd(&j, UNDO_DELETE, 1, 0, "second\nthird\nfourth", 19, 0);
+    check("delete past the last row", &j, 0, 0, "hello world|second|third");
+
+    journalStart(&j);
+    journalAdd(&j, UNDO_DELETE, 0, 6, "world\nsecond\nthirdly", 20, 0);
+    check("delete past the end of its last row", &j, 0, 0, "hello world|second|third");
+
+    journalStart(&j);
+    journalAdd(&j, UNDO_DELETE, 0, 6, "wordl\nsec", 9, 0);
+    check("delete of text that is not there", &j, 0, 0, "hello world|second|third");
+
+    journalStart(&j);
+    journalAdd(&j, UNDO_DELETE, 2, 1, "hurd", 4, 0);
+    check("delete of text that is not there, on one row", &j, 0, 0, "hello world|second|third");
+
+    journalStart(&j);
+    journalAdd(&j, UNDO_DELETE, 0, 6, "world\nsecond\nthi", 16, 0);
+    check("delete across rows", &j, 0, 1, "hello rd");
+
+    journalStart(&j);
+    journalAdd(&j, UNDO_DELETE, 5, 0, "x", 1, 0);
+    journalAdd(&j, UNDO_DELETE, 0, 40, "x", 1, 0);
+    check("delete on a row that is not there", &j, 0, 0, "hello world|second|third");
+
+    // the second record loses its last byte, as a crash while writing it would
+    journalStart(&j);
+    journalAdd(&j, UNDO_DELETE, 0, 0, "hello ", 6, 0);
+    journalAdd(&j, UNDO_DELETE, 0, 0, "world", 5, 0);
+    check("record cut short", &j, j.len - 1, 1, "world|second|third");
+
+    printf("journal replay: %d bad\n", bad);
+    return bad != 0;
+}
@@ -0,0 +1,209 @@
+/*
+ * Checks Find's regex engine: fixed cases first, then random patterns and
+ * lines matched against a slow reference that walks the syntax tree.
+ *
+ * tests/run.sh runs it with the defaults. To pick the seed and how many
+ * random patterns:
+ *
+ *   cc -O2 -pthread -o regex_check tests/regex_check.c
+ *   ./regex_check [seed] [patterns]
+ */
+
+#define main kayrak_main
+#include "../kayrak.c"
+#undef main
+
+// each start on the line and the end of the longest match there
+static const struct {
+    const char *pattern, *line, *want;
+} cases[] = {
+    { "a$$", "a", "0-1" },
+    { "^^a", "a", "0-1" },
+    { "^(^a)", "a", "0-1" },
+    { "(.*$|z)+$", "a", "0-1 1-1" },
+    { "^$", "", "0-0" },
+    { "$^", "", "0-0" },
+    { "a$^", "a", "" },
+    { "^a|b$", "ab", "0-1 1-2" },
+    { "(^|x)y", "yxy", "0-1 1-3" },
+    { "x($|y)", "xyx", "0-2 2-3" },
+    { "\\T\\N\\R\\F\\V", "xTNRFV", "1-6" },
+    { "\\t", "a\tT", "1-2" },
+    { "[\\T]", "\tT", "1-2" },
+    { "\\D\\W\\S", "a1 a-b", "3-6" },
+    { "(([^a]a|b[^a]$)$)*[ab]*", "bc xax c1bc",
+      "0-1 1-1 2-2 3-3 4-5 5-5 6-6 7-7 8-8 9-11 10-10 11-11" },
+};
+
+static void matches(struct reMatcher *m, const char *s, int len, char *out) {
+    int n = regexStarts(m, s, len), i;
+    out[0] = '\0';
+    for (i = 0; i < n; i++)
+        out += sprintf(out, "%s%d-%d", i ? " " : "", m->starts[i], regexEnd(m, s, len, m->starts[i]));
+}
+
+/* the reference */
+
+static const struct reAst *refast;
+static const char *refline;
+static int reflen;
+
+// the ends of t's matches from the starts in `from`, as bit masks
+static unsigned refEnds(int t, unsigned from) {
+    const struct reAst *a = &refast[t];
+    unsigned out = 0, cur;
+    int i, k;
+
+    switch (a->type) {
+        case AST_EMPTY:
+            return from;
+        case AST_ANCHOR:
+            for (i = 0; i <= reflen; i++)
+                if ((from >> i & 1) && i == (a->min == RE_BOL ? 0 : reflen)) out |= 1u << i;
+            return out;
+        case AST_SET:
+            for (i = 0; i < reflen; i++)
+                if ((from >> i & 1) && reSetHas(a->set, (unsigned char)refline[i])) out |= 1u << (i + 1);
+            return out;
+        case AST_CAT:
+            return refEnds(a->b, refEnds(a->a, from));
+        case AST_ALT:
+            return refEnds(a->a, from) | refEnds(a->b, from);
+        case AST_REPEAT:
+            cur = from;
+            for (k = 0; k < a->min; k++) cur = refEnds(a->a, cur);
+            out = cur;
+            for (k = a->min; cur && (a->max == -1 || k < a->max); k++) {
+                cur = refEnds(a->a, cur);
+                if ((out | cur) == out && a->max == -1) break;
+                out |= cur;
+            }
+            return out;
+    }
+    return 0;
+}
+
+static char pat[512];
+static int patlen;
+
+static void genPattern(int depth) {
+    static const char *classes[] = { "[ab]", "[^a]", "[a-b]", "\\w", "\\s", "\\D" };
+    const char *c;
+
+    switch (rand() % (depth > 3 ? 4 : 12)) {
+        case 0: case 1: case 2:
+            pat[patlen++] = "abc."[rand() % 4];
+            break;
+        case 3:
+            c = classes[rand() % 6];
+            patlen += sprintf(&pat[patlen], "%s", c);
+            break;
+        case 4:
+            genPattern(depth + 1);
+            genPattern(depth + 1);
+            break;
+        case 5:
+            pat[patlen++] = '(';
+            genPattern(depth + 1);
+            pat[patlen++] = '|';
+            genPattern(depth + 1);
+            pat[patlen++] = ')';
+            break;
+        case 6:
+            pat[patlen++] = '(';
+            genPattern(depth + 1);
+            pat[patlen++] = ')';
+            pat[patlen++] = "*+?"[rand() % 3];
+            break;
+        case 7:
+            pat[patlen++] = '(';
+            genPattern(depth + 1);
+            patlen += sprintf(&pat[patlen], "){%d,%d}", rand() % 2, 1 + rand() % 3);
+            break;
+        case 8:
+            pat[patlen++] = "abc"[rand() % 3];
+            pat[patlen++] = "*+?"[rand() % 3];
+            break;
+        case 9:
+            genPattern(depth + 1);
+            break;
+        case 10:
+            genPattern(depth + 1);
+            genPattern(depth + 1);
+            genPattern(depth + 1);
+            break;
+        case 11:
+            pat[patlen++] = "^$"[rand() % 2];
+            break;
+    }
+}
+
+int main(int argc, char **argv) {
+    char got[512], want[512];
+    int bad = 0, i, j, k;
+
+    for (i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++) {
+        const char *err;
+        struct regex *re = regexCompile(cases[i].pattern, &err);
+        if (re == NULL) {
+            printf("%s: %s\n", cases[i].pattern, err);
+            bad++;
+            continue;
+        }
+        struct reMatcher *m = regexMatcher(re);
+        matches(m, cases[i].line, strlen(cases[i].line), got);
+        if (strcmp(got, cases[i].want) != 0) {
+            printf("%s on \"%s\": got \"%s\", want \"%s\"\n", cases[i].pattern, cases[i].line, got, cases[i].want);
+            bad++;
+        }
+        regexMatcherFree(m);
+        regexFree(re);
+    }
+
+    srand(argc > 1 ? atoi(argv[1]) : 1);
+    int patterns = argc > 2 ? atoi(argv[2]) : 20000;
+    for (i = 0; i < patterns; i++) {
+        patlen = 0;
+        genPattern(0);
+        pat[patlen] = '\0';
+
+        const char *err;
+        struct reParser ps = { pat, NULL, NULL, 0, 0 };
+        int root = reAlt(&ps);
+        struct regex *re = regexCompile(pat, &err);
+        if (re == NULL || ps.err) {
+            printf("%s: %s\n", pat, re ? ps.err : err);
+            bad++;
+            free(ps.ast);
+            regexFree(re);
+            continue;
+        }
+        struct reMatcher *m = regexMatcher(re);
+        refast = ps.ast;
+
+        for (j = 0; j < 20; j++) {
+            char line[16];
+            reflen = rand() % (int)sizeof(line);
+            for (k = 0; k < reflen; k++) line[k] = "abcab c"[rand() % 7];
+            refline = line;
+
+            char *w = want;
+            *w = '\0';
+            for (k = 0; k <= reflen; k++) {
+                unsigned ends = refEnds(root, 1u << k);
+                if (ends) w += sprintf(w, "%s%d-%d", w > want ? " " : "", k, 31 - __builtin_clz(ends));
+            }
+            matches(m, line, reflen, got);
+            if (strcmp(got, want) != 0 || regexLineMatches(m, line, reflen) != (want[0] != '\0')) {
+                if (bad < 10) printf("%s on \"%.*s\": got \"%s\", want \"%s\"\n", pat, reflen, line, got, want);
+                bad++;
+            }
+        }
+        regexMatcherFree(m);
+        regexFree(re);
+        free(ps.ast);
+    }
+
+    printf("%d cases, %d random patterns: %d bad\n", (int)(sizeof(cases) / sizeof(cases[0])), patterns, bad);
+    return bad != 0;
+}
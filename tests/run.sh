@@ -0,0 +1,23 @@
+#!/bin/sh
+# Builds each tests/*.c against kayrak.c and runs it from the top of the
+# tree, where config.txt is. Exits non-zero if any test fails to build or run.
+#
+#   tests/run.sh [cc flags...]
+
+cd "$(dirname "$0")/.." || exit 1
+CC=${CC:-cc}
+out=$(mktemp -d) || exit 1
+trap 'rm -rf "$out"' EXIT
+
+failed=0
+for test in tests/*.c; do
+    name=$(basename "$test" .c)
+    if ! $CC -O2 -pthread "$@" -o "$out/$name" "$test"; then
+        echo "$name: does not build"
+        failed=1
+    elif ! "$out/$name"; then
+        echo "$name: FAILED"
+        failed=1
+    fi
+done
+exit $failed